@@ -0,0 +1,246 @@
+// In-process benchmark of the myfs handlers: no FUSE mount needed. The
+// handlers are driven through driver.h.
+//
+// Every operation is timed on its own and reported as operations per second
+// and latency percentiles. The store lives in a fresh temporary directory,
+// which is removed afterwards.
+//
+// Usage: myfs_bench [scale], where scale (default 1) multiplies the number
+// of operations of every workload.
+
+#define main myfs_main
+#include "myfs.c"
+#undef main
+
+#include "driver.h"
+
+// Latencies of the operations of one workload, in nanoseconds.
+typedef struct {
+  uint64_t *ns;
+  size_t n;
+  size_t cap;
+  uint64_t start;
+} timing;
+
+static void timingStart(timing *t, size_t cap) {
+  t->ns = malloc(cap * sizeof(uint64_t));
+  if (t->ns == NULL) {
+    perror("myfs_bench");
+    exit(1);
+  }
+  t->n = 0;
+  t->cap = cap;
+  t->start = nowNs();
+}
+
+static void timingAdd(timing *t, uint64_t ns) {
+  if (t->n < t->cap)
+    t->ns[t->n++] = ns;
+}
+
+static int compareNs(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentileUs(const timing *t, double p) {
+  size_t i = (size_t)(p * (t->n - 1) + 0.5);
+  return t->ns[i] / 1000.0;
+}
+
+// Print one result line and free the timings.
+static void report(timing *t, const char *op, const char *param) {
+  uint64_t wall = nowNs() - t->start;
+  if (t->n > 0) {
+    qsort(t->ns, t->n, sizeof(uint64_t), compareNs);
+    printf("%-12s %-18s %8zu %12.0f %9.1f %9.1f %9.1f %9.1f\n", op, param,
+           t->n, t->n / (wall / 1e9), percentileUs(t, 0.5),
+           percentileUs(t, 0.9), percentileUs(t, 0.99), percentileUs(t, 1.0));
+  }
+  free(t->ns);
+}
+
+// Directory workloads: 'fanout' files created in one directory, looked up,
+// stat'ed, listed and unlinked, then 'dirs' directories made and removed.
+static void benchDirectory(size_t fanout, size_t dirs) {
+  char param[48], name[48];
+  snprintf(param, sizeof(param), "fanout=%zu", fanout);
+  fuse_ino_t dir = doMkdir(FUSE_ROOT_ID, param);
+  fuse_ino_t *inos = malloc(fanout * sizeof(fuse_ino_t));
+  timing t;
+
+  timingStart(&t, fanout);
+  for (size_t i = 0; i < fanout; i++) {
+    struct fuse_file_info fi;
+    snprintf(name, sizeof(name), "f%zu", i);
+    uint64_t start = nowNs();
+    inos[i] = doCreate(dir, name, &fi);
+    doRelease(inos[i], &fi);
+    timingAdd(&t, nowNs() - start);
+  }
+  report(&t, "create", param);
+
+  timingStart(&t, fanout);
+  for (size_t i = 0; i < fanout; i++) {
+    snprintf(name, sizeof(name), "f%zu", i);
+    uint64_t start = nowNs();
+    doLookup(dir, name);
+    timingAdd(&t, nowNs() - start);
+  }
+  report(&t, "lookup", param);
+
+  timingStart(&t, fanout);
+  for (size_t i = 0; i < fanout; i++) {
+    uint64_t start = nowNs();
+    doGetattr(inos[i]);
+    timingAdd(&t, nowNs() - start);
+  }
+  report(&t, "getattr", param);
+
+  size_t listings = 100000 / fanout + 1;
+  timingStart(&t, listings);
+  for (size_t i = 0; i < listings; i++) {
+    uint64_t start = nowNs();
+    size_t n = doReaddir(dir);
+    timingAdd(&t, nowNs() - start);
+    if (n != fanout + 2) {
+      fprintf(stderr, "myfs_bench: readdir listed %zu of %zu entries\n", n,
+              fanout + 2);
+      exit(1);
+    }
+  }
+  report(&t, "readdir", param);
+
+  timingStart(&t, fanout);
+  for (size_t i = 0; i < fanout; i++) {
+    snprintf(name, sizeof(name), "f%zu", i);
+    uint64_t start = nowNs();
+    doUnlink(dir, name);
+    timingAdd(&t, nowNs() - start);
+    // One reference from create, one from lookup
+    doForget(inos[i], 2);
+  }
+  report(&t, "unlink", param);
+
+  timingStart(&t, dirs);
+  for (size_t i = 0; i < dirs; i++) {
+    snprintf(name, sizeof(name), "d%zu", i);
+    uint64_t start = nowNs();
+    doForget(doMkdir(dir, name), 1);
+    timingAdd(&t, nowNs() - start);
+  }
+  report(&t, "mkdir", param);
+
+  timingStart(&t, dirs);
+  for (size_t i = 0; i < dirs; i++) {
+    snprintf(name, sizeof(name), "d%zu", i);
+    uint64_t start = nowNs();
+    doRmdir(dir, name);
+    timingAdd(&t, nowNs() - start);
+  }
+  report(&t, "rmdir", param);
+
+  snprintf(name, sizeof(name), "fanout=%zu", fanout);
+  doRmdir(FUSE_ROOT_ID, name);
+  doForget(dir, 1);
+  free(inos);
+}
+
+// Data workloads on a file of 'fileSize' bytes with requests of 'ioSize'
+// bytes: written and read sequentially, then at random offsets.
+static void benchData(size_t fileSize, size_t ioSize, unsigned rounds) {
+  char param[48];
+  snprintf(param, sizeof(param), "file=%zuK,io=%zuK", fileSize >> 10,
+           ioSize >> 10);
+  size_t ops = fileSize / ioSize;
+  char *buf = malloc(ioSize);
+  for (size_t i = 0; i < ioSize; i++)
+    buf[i] = (char)(i * 31 + 7);
+  struct fuse_file_info fi;
+  fuse_ino_t ino = doCreate(FUSE_ROOT_ID, "data", &fi);
+  timing t;
+
+  timingStart(&t, ops * rounds);
+  for (unsigned round = 0; round < rounds; round++) {
+    for (size_t i = 0; i < ops; i++) {
+      uint64_t start = nowNs();
+      doWrite(ino, &fi, buf, ioSize, (off_t)i * ioSize);
+      timingAdd(&t, nowNs() - start);
+    }
+  }
+  report(&t, "seq-write", param);
+
+  timingStart(&t, ops * rounds);
+  for (unsigned round = 0; round < rounds; round++) {
+    for (size_t i = 0; i < ops; i++) {
+      uint64_t start = nowNs();
+      doRead(ino, &fi, buf, ioSize, (off_t)i * ioSize);
+      timingAdd(&t, nowNs() - start);
+    }
+  }
+  report(&t, "seq-read", param);
+
+  srand(1);
+  timingStart(&t, ops * rounds);
+  for (size_t i = 0; i < ops * rounds; i++) {
+    off_t off = (off_t)(rand() % ops) * ioSize;
+    uint64_t start = nowNs();
+    doWrite(ino, &fi, buf, ioSize, off);
+    timingAdd(&t, nowNs() - start);
+  }
+  report(&t, "rand-write", param);
+
+  timingStart(&t, ops * rounds);
+  for (size_t i = 0; i < ops * rounds; i++) {
+    off_t off = (off_t)(rand() % ops) * ioSize;
+    uint64_t start = nowNs();
+    doRead(ino, &fi, buf, ioSize, off);
+    timingAdd(&t, nowNs() - start);
+  }
+  report(&t, "rand-read", param);
+
+  doRelease(ino, &fi);
+  doUnlink(FUSE_ROOT_ID, "data");
+  doForget(ino, 1);
+  free(buf);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned scale = argc > 1 ? (unsigned)atoi(argv[1]) : 1;
+  if (scale == 0) {
+    fprintf(stderr, "usage: %s [scale]\n", argv[0]);
+    return 1;
+  }
+
+  // A fresh store in a temporary directory
+  char dir[] = "/tmp/myfs-bench.XXXXXX";
+  if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+    perror("myfs_bench");
+    return 1;
+  }
+  myfs_log_level = MYFS_LOG_OFF;
+  init_log_file();
+  init_fs();
+  struct fuse_conn_info conn;
+  memset(&conn, 0, sizeof(conn));
+  myfs_oper.init(NULL, &conn);
+
+  printf("%-12s %-18s %8s %12s %9s %9s %9s %9s\n", "op", "param", "ops",
+         "ops/s", "p50 us", "p90 us", "p99 us", "max us");
+  static const size_t fanouts[] = {10, 1000, 10000};
+  for (size_t i = 0; i < sizeof(fanouts) / sizeof(fanouts[0]); i++)
+    benchDirectory(fanouts[i] * scale, 1000 * scale);
+  static const size_t fileSizes[] = {1 << 20, 16 << 20};
+  static const size_t ioSizes[] = {4 << 10, 128 << 10};
+  for (size_t i = 0; i < sizeof(fileSizes) / sizeof(fileSizes[0]); i++) {
+    for (size_t j = 0; j < sizeof(ioSizes) / sizeof(ioSizes[0]); j++)
+      benchData(fileSizes[i], ioSizes[j], scale);
+  }
+
+  shutdown_fs();
+  unlink(DATABASE_NAME);
+  unlink("myfs.log");
+  if (chdir("/") == 0)
+    rmdir(dir);
+  return 0;
+}
@@ -0,0 +1,189 @@
+#!/bin/sh
+# End-to-end benchmark: mounts myfs on a temporary directory, runs scripted
+# metadata and data workloads against it and prints the results as JSON.
+# Everything, store included, lives under a temporary directory that is
+# removed afterwards. Needs fusermount, and python3 for the random writes.
+#
+# Usage: ./benchmount.sh [results.json]
+#
+# Tunables, from the environment:
+#   BENCH_TREE        directory tarred up and untarred (default /usr/include/linux)
+#   BENCH_JOBS        parallel small-file workers (default 4)
+#   BENCH_FILES       files created and deleted by each worker (default 500)
+#   BENCH_STREAM_MB   size of the streamed file in MiB (default 256)
+#   BENCH_RANDOM_OPS  random 4 KiB overwrites (default 2000)
+#   MYFS_OPTS         extra mount options, e.g. "-o log_level=off"
+
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+myfs="$here/myfs"
+out=${1:-/dev/stdout}
+tree=${BENCH_TREE:-/usr/include/linux}
+jobs=${BENCH_JOBS:-4}
+files=${BENCH_FILES:-500}
+streamMB=${BENCH_STREAM_MB:-256}
+randomOps=${BENCH_RANDOM_OPS:-2000}
+
+if [ ! -x "$myfs" ]; then
+  echo "benchmount: build myfs first (make)" >&2
+  exit 1
+fi
+if [ ! -d "$tree" ]; then
+  echo "benchmount: no source tree at $tree, set BENCH_TREE" >&2
+  exit 1
+fi
+
+work=$(mktemp -d /tmp/myfs-benchmount.XXXXXX)
+myfsPid=
+mnt="$work/mnt"
+mkdir "$mnt" "$work/store"
+
+now() { date +%s.%N; }
+
+# Seconds elapsed since $1
+since() { echo "$1 $(now)" | awk '{ printf "%.3f", $2 - $1 }'; }
+
+# $1 per second over $2 seconds
+rate() { echo "$1 $2" | awk '{ printf "%.1f", ($2 > 0 ? $1 / $2 : 0) }'; }
+
+isMounted() { grep -q " $mnt fuse" /proc/mounts; }
+
+# myfs keeps its store in the directory it is started from, so a remount
+# sees the same files. It runs in the foreground, in the background of this
+# script, so an unmount can wait for it to close the store.
+mountFS() {
+  (cd "$work/store" && exec "$myfs" -f $MYFS_OPTS "$mnt" >>"$work/myfs.out" 2>&1) &
+  myfsPid=$!
+  tries=0
+  until isMounted; do
+    tries=$((tries + 1))
+    if [ $tries -gt 100 ]; then
+      echo "benchmount: myfs did not mount" >&2
+      exit 1
+    fi
+    sleep 0.1
+  done
+}
+
+unmountFS() {
+  if isMounted; then
+    fusermount -u "$mnt"
+  fi
+  if [ -n "$myfsPid" ]; then
+    wait "$myfsPid" || true
+    myfsPid=
+  fi
+}
+
+cleanup() {
+  unmountFS || true
+  rm -rf "$work"
+}
+trap cleanup EXIT INT TERM
+
+results=""
+# Add one result object, given as its JSON members
+result() {
+  results="$results${results:+,
+}    {$1}"
+}
+
+# Links are stored as the files they point to: myfs has no links
+tar -C "$(dirname "$tree")" -chf "$work/tree.tar" "$(basename "$tree")"
+treeFiles=$(tar -tf "$work/tree.tar" | grep -vc '/$' || true)
+treeBytes=$(wc -c < "$work/tree.tar")
+
+mountFS
+
+# Untar a source tree
+start=$(now)
+tar -C "$mnt" --no-same-owner -xf "$work/tree.tar"
+sync
+t=$(since "$start")
+result "\"name\": \"untar\", \"seconds\": $t, \"files\": $treeFiles, \"tar_bytes\": $treeBytes, \"files_per_sec\": $(rate "$treeFiles" "$t")"
+
+# Stat every file of it, from a cold kernel cache
+unmountFS
+mountFS
+start=$(now)
+statted=$(find "$mnt" -type f | xargs stat -c %s | wc -l)
+t=$(since "$start")
+result "\"name\": \"find-stat\", \"seconds\": $t, \"files\": $statted, \"files_per_sec\": $(rate "$statted" "$t")"
+rm -rf "${mnt:?}/$(basename "$tree")"
+
+# Parallel small-file create and delete, one directory per worker
+start=$(now)
+workers=""
+i=0
+while [ $i -lt "$jobs" ]; do
+  (
+    d="$mnt/worker$i"
+    mkdir "$d"
+    n=0
+    while [ $n -lt "$files" ]; do
+      echo "file $n of worker $i" > "$d/f$n"
+      n=$((n + 1))
+    done
+    n=0
+    while [ $n -lt "$files" ]; do
+      rm "$d/f$n"
+      n=$((n + 1))
+    done
+    rmdir "$d"
+  ) &
+  workers="$workers $!"
+  i=$((i + 1))
+done
+# Not a bare wait: myfs itself is a child too
+for pid in $workers; do
+  wait "$pid"
+done
+t=$(since "$start")
+ops=$((jobs * files * 2))
+result "\"name\": \"small-files\", \"seconds\": $t, \"jobs\": $jobs, \"files\": $((jobs * files)), \"ops_per_sec\": $(rate "$ops" "$t")"
+
+# Large sequential streaming, written and then read back after a remount so
+# the reads reach myfs
+bytes=$((streamMB * 1024 * 1024))
+start=$(now)
+dd if=/dev/zero of="$mnt/stream" bs=1M count="$streamMB" conv=fsync 2>/dev/null
+t=$(since "$start")
+result "\"name\": \"seq-write\", \"seconds\": $t, \"bytes\": $bytes, \"mib_per_sec\": $(rate "$streamMB" "$t")"
+unmountFS
+mountFS
+start=$(now)
+dd if="$mnt/stream" of=/dev/null bs=1M 2>/dev/null
+t=$(since "$start")
+result "\"name\": \"seq-read\", \"seconds\": $t, \"bytes\": $bytes, \"mib_per_sec\": $(rate "$streamMB" "$t")"
+
+# Random 4 KiB overwrites of the streamed file, from a single process
+start=$(now)
+python3 - "$mnt/stream" "$streamMB" "$randomOps" <<'EOF'
+import os, random, sys
+path, mib, ops = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+blocks = mib * 256
+block = os.urandom(4096)
+rng = random.Random(1)
+fd = os.open(path, os.O_WRONLY)
+for _ in range(ops):
+    os.pwrite(fd, block, rng.randrange(blocks) * 4096)
+os.fsync(fd)
+os.close(fd)
+EOF
+t=$(since "$start")
+result "\"name\": \"random-overwrite\", \"seconds\": $t, \"ops\": $randomOps, \"ops_per_sec\": $(rate "$randomOps" "$t")"
+rm "$mnt/stream"
+
+unmountFS
+
+cat > "$out" <<EOF
+{
+  "fs": "myfs",
+  "date": "$(date -u +%Y-%m-%dT%H:%M:%SZ)",
+  "kernel": "$(uname -r)",
+  "results": [
+$results
+  ]
+}
+EOF
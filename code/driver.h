@@ -0,0 +1,255 @@
+// Drives the myfs handlers in-process, for myfs_bench and myfs_test: no FUSE
+// mount needed.
+//
+// The handlers are static and myfs.h defines functions of its own, so a
+// program using this includes myfs.c whole, then this file, and calls the
+// handlers through myfs_oper, the way the FUSE session loop would. The
+// fuse_reply_* functions the handlers answer with are defined here instead
+// of in libfuse: they record the reply in our own struct fuse_req, so a
+// request costs exactly the handler and the store underneath it.
+
+// What a handler replied.
+struct fuse_req {
+  int err; // errno of an error reply, 0 otherwise
+  fuse_ino_t ino; // inode of an entry reply
+  struct stat attr; // attributes of an entry or attr reply
+  char *data; // where a data reply is copied to
+  size_t cap;
+  size_t count; // bytes of a data reply, or written by a write
+};
+
+int fuse_reply_err(fuse_req_t req, int err) {
+  req->err = err;
+  return 0;
+}
+
+void fuse_reply_none(fuse_req_t req) { (void)req; }
+
+int fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e) {
+  req->ino = e->ino;
+  req->attr = e->attr;
+  return 0;
+}
+
+int fuse_reply_create(fuse_req_t req, const struct fuse_entry_param *e,
+                      const struct fuse_file_info *fi) {
+  (void)fi;
+  req->ino = e->ino;
+  return 0;
+}
+
+int fuse_reply_attr(fuse_req_t req, const struct stat *attr,
+                    double attr_timeout) {
+  (void)attr_timeout;
+  req->attr = *attr;
+  return 0;
+}
+
+int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi) {
+  (void)req;
+  (void)fi;
+  return 0;
+}
+
+int fuse_reply_write(fuse_req_t req, size_t count) {
+  req->count = count;
+  return 0;
+}
+
+int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size) {
+  if (size > req->cap)
+    size = req->cap;
+  memcpy(req->data, buf, size);
+  req->count = size;
+  return 0;
+}
+
+// Fail the program if a handler replied with an error.
+#define CHECK(req, what)                                                       \
+  do {                                                                         \
+    if ((req).err != 0) {                                                      \
+      fprintf(stderr, "%s: %s\n", (what), strerror((req).err));               \
+      exit(1);                                                                 \
+    }                                                                          \
+  } while (0)
+
+#define REQ(r) struct fuse_req r = {0}
+
+// Monotonic clock, for timing handlers.
+static uint64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The operations, as the kernel would send them. Each returns what the
+// handler replied with and exits on an error, but for the try* ones, which
+// return the errno of an error reply and 0 otherwise.
+
+static inline fuse_ino_t doMkdir(fuse_ino_t parent, const char *name) {
+  REQ(r);
+  myfs_oper.mkdir(&r, parent, name, S_IFDIR | 0755);
+  CHECK(r, "mkdir");
+  return r.ino;
+}
+
+static inline void doRmdir(fuse_ino_t parent, const char *name) {
+  REQ(r);
+  myfs_oper.rmdir(&r, parent, name);
+  CHECK(r, "rmdir");
+}
+
+static inline fuse_ino_t doCreate(fuse_ino_t parent, const char *name,
+                                  struct fuse_file_info *fi) {
+  REQ(r);
+  memset(fi, 0, sizeof(*fi));
+  fi->flags = O_RDWR;
+  myfs_oper.create(&r, parent, name, S_IFREG | 0644, fi);
+  CHECK(r, "create");
+  return r.ino;
+}
+
+static inline void doOpen(fuse_ino_t ino, struct fuse_file_info *fi) {
+  REQ(r);
+  memset(fi, 0, sizeof(*fi));
+  fi->flags = O_RDWR;
+  myfs_oper.open(&r, ino, fi);
+  CHECK(r, "open");
+}
+
+static inline void doRelease(fuse_ino_t ino, struct fuse_file_info *fi) {
+  REQ(r);
+  myfs_oper.flush(&r, ino, fi);
+  CHECK(r, "flush");
+  myfs_oper.release(&r, ino, fi);
+  CHECK(r, "release");
+}
+
+static inline fuse_ino_t doLookup(fuse_ino_t parent, const char *name) {
+  REQ(r);
+  myfs_oper.lookup(&r, parent, name);
+  CHECK(r, "lookup");
+  return r.ino;
+}
+
+static inline int tryLookup(fuse_ino_t parent, const char *name,
+                            fuse_ino_t *ino) {
+  REQ(r);
+  myfs_oper.lookup(&r, parent, name);
+  *ino = r.ino;
+  return r.err;
+}
+
+static inline struct stat doGetattr(fuse_ino_t ino) {
+  REQ(r);
+  myfs_oper.getattr(&r, ino, NULL);
+  CHECK(r, "getattr");
+  return r.attr;
+}
+
+static inline struct stat doTruncate(fuse_ino_t ino, off_t size) {
+  REQ(r);
+  struct stat attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.st_size = size;
+  myfs_oper.setattr(&r, ino, &attr, FUSE_SET_ATTR_SIZE, NULL);
+  CHECK(r, "truncate");
+  return r.attr;
+}
+
+static inline void doUnlink(fuse_ino_t parent, const char *name) {
+  REQ(r);
+  myfs_oper.unlink(&r, parent, name);
+  CHECK(r, "unlink");
+}
+
+static inline int tryRename(fuse_ino_t parent, const char *name,
+                            fuse_ino_t newparent, const char *newname) {
+  REQ(r);
+  myfs_oper.rename(&r, parent, name, newparent, newname);
+  return r.err;
+}
+
+static inline void doForget(fuse_ino_t ino, unsigned long nlookup) {
+  REQ(r);
+  myfs_oper.forget(&r, ino, nlookup);
+}
+
+static inline void doWrite(fuse_ino_t ino, struct fuse_file_info *fi, char *buf,
+                           size_t size, off_t off) {
+  REQ(r);
+  struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+  bufv.buf[0].mem = buf;
+  myfs_oper.write_buf(&r, ino, &bufv, off, fi);
+  CHECK(r, "write");
+}
+
+// Returns the number of bytes read, fewer than 'size' at the end of the file.
+static inline size_t doRead(fuse_ino_t ino, struct fuse_file_info *fi,
+                            char *buf, size_t size, off_t off) {
+  REQ(r);
+  r.data = buf;
+  r.cap = size;
+  myfs_oper.read(&r, ino, size, off, fi);
+  CHECK(r, "read");
+  return r.count;
+}
+
+static inline void doOpendir(fuse_ino_t ino, struct fuse_file_info *fi) {
+  REQ(r);
+  memset(fi, 0, sizeof(*fi));
+  myfs_oper.opendir(&r, ino, fi);
+  CHECK(r, "opendir");
+}
+
+static inline void doReleasedir(fuse_ino_t ino, struct fuse_file_info *fi) {
+  REQ(r);
+  myfs_oper.releasedir(&r, ino, fi);
+  CHECK(r, "releasedir");
+}
+
+// Read a page of the entries of the open directory 'ino' from '*off' on, the
+// way the kernel does, and move '*off' past them. 'visit', if not NULL, is
+// called with the name of each. Returns the number of entries, 0 at the end.
+static inline size_t doReaddirPage(fuse_ino_t ino, struct fuse_file_info *fi,
+                                   off_t *off,
+                                   void (*visit)(const char *name, void *arg),
+                                   void *arg) {
+  char page[4096];
+  REQ(r);
+  r.data = page;
+  r.cap = sizeof(page);
+  myfs_oper.readdir(&r, ino, sizeof(page), *off, fi);
+  CHECK(r, "readdir");
+  // Walk the packed struct fuse_dirent records
+  size_t entries = 0, pos = 0;
+  while (pos < r.count) {
+    uint64_t next;
+    uint32_t namelen;
+    memcpy(&next, page + pos + 8, sizeof(next));
+    memcpy(&namelen, page + pos + 16, sizeof(namelen));
+    if (visit != NULL) {
+      char name[MY_MAX_NAME + 1];
+      memcpy(name, page + pos + 24, namelen);
+      name[namelen] = '\0';
+      visit(name, arg);
+    }
+    *off = next;
+    entries++;
+    pos += (24 + namelen + 7) & ~(size_t)7;
+  }
+  return entries;
+}
+
+// List a whole directory from opendir to releasedir. Returns the number of
+// entries, "." and ".." included.
+static inline size_t doReaddir(fuse_ino_t ino) {
+  struct fuse_file_info fi;
+  doOpendir(ino, &fi);
+  size_t entries = 0, n;
+  off_t off = 0;
+  while ((n = doReaddirPage(ino, &fi, &off, NULL, NULL)) > 0)
+    entries += n;
+  doReleasedir(ino, &fi);
+  return entries;
+}
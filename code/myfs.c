@@ -11,7 +11,8 @@
 
 #include <errno.h>
 #include <fcntl.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stddef.h>
 
 #include "myfs.h"
 
@@ -26,1065 +27,3231 @@ unqlite_int64 root_object_size_value = sizeof(myfcb);
 unqlite *pDb;
 uuid_t zero_uuid;
 
-int getFCBFromPath(const char *path, myfcb *returnFCB) {
-  char charPth[strlen(path) + 1];
-  strcpy(charPth, path);
+// Group commit. UnQLite keeps every change in one write transaction until
+// it is committed, so without explicit commits nothing would be durable
+// before unmount and the journal would grow without bound. Committing after
+// every operation would cost an fsync each, so operations are grouped
+// instead: the batch is committed once it has dirtied commitBytes, or by the
+// commit thread once it is commitIntervalMs old, whichever comes first. A
+// crash loses at most the last batch.
+//
+// Mutating handlers run between txnEnter and txnExit, which hold the commit
+// gate shared. A commit takes the gate exclusively, so it never lands in the
+// middle of an operation.
+static pthread_rwlock_t txnGate = PTHREAD_RWLOCK_INITIALIZER;
+static atomic_ullong txnDirtyBytes;
+static pthread_mutex_t txnTimerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t txnTimerCond = PTHREAD_COND_INITIALIZER;
+static bool txnRunning;
+static pthread_t txnThread;
+static long commitIntervalMs = COMMIT_INTERVAL_MS;
+static unsigned long long commitBytes = COMMIT_BYTES;
+
+// Count 'bytes' written to the store by the current batch.
+static void txnDirty(size_t bytes) {
+  atomic_fetch_add_explicit(&txnDirtyBytes, bytes, memory_order_relaxed);
+}
 
-  char *token = strtok(charPth, "/");
-  unqlite_int64 nBytes;
-  int result;
-  myfcb value = the_root_fcb;
+// Commit the current batch, if there is anything in it, and start the next.
+static int txnCommit() {
+  int rc = UNQLITE_OK;
+  pthread_rwlock_wrlock(&txnGate);
+  if (atomic_load(&txnDirtyBytes) > 0) {
+    rc = unqlite_commit(pDb);
+    if (rc == UNQLITE_OK)
+      rc = unqlite_begin(pDb);
+    if (rc == UNQLITE_OK)
+      atomic_store(&txnDirtyBytes, 0);
+    else
+      log_error("group commit failed: %d\n", rc);
+  }
+  pthread_rwlock_unlock(&txnGate);
+  return rc == UNQLITE_OK ? 0 : -EIO;
+}
 
-  while (token != NULL) {
-    if (!S_ISDIR(value.mode)) {
-      if (strtok(NULL, "/") != NULL) {
-        return -ENOENT;
-      }
-      break;
+static void txnEnter() { pthread_rwlock_rdlock(&txnGate); }
+
+static void txnExit() {
+  pthread_rwlock_unlock(&txnGate);
+  if (atomic_load_explicit(&txnDirtyBytes, memory_order_relaxed) >=
+      commitBytes)
+    txnCommit();
+}
+
+static void *txnThreadMain(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&txnTimerLock);
+  while (txnRunning) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (commitIntervalMs % 1000) * 1000000;
+    deadline.tv_sec += commitIntervalMs / 1000 + deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    pthread_cond_timedwait(&txnTimerCond, &txnTimerLock, &deadline);
+    pthread_mutex_unlock(&txnTimerLock);
+    txnCommit();
+    pthread_mutex_lock(&txnTimerLock);
+  }
+  pthread_mutex_unlock(&txnTimerLock);
+  return NULL;
+}
+
+// Start the commit thread. Like the log thread, this has to happen after
+// FUSE has daemonised.
+static void txnStart() {
+  // Make whatever init_fs wrote durable before the first batch starts
+  if (unqlite_commit(pDb) != UNQLITE_OK || unqlite_begin(pDb) != UNQLITE_OK)
+    log_error("could not begin a transaction\n");
+  pthread_mutex_lock(&txnTimerLock);
+  txnRunning = pthread_create(&txnThread, NULL, txnThreadMain, NULL) == 0;
+  pthread_mutex_unlock(&txnTimerLock);
+}
+
+// Stop the commit thread and commit whatever is left.
+static void txnStop() {
+  pthread_mutex_lock(&txnTimerLock);
+  bool wasRunning = txnRunning;
+  txnRunning = false;
+  pthread_cond_signal(&txnTimerCond);
+  pthread_mutex_unlock(&txnTimerLock);
+  if (wasRunning)
+    pthread_join(txnThread, NULL);
+  txnCommit();
+}
+
+// Per-operation statistics: how often each handler has run, a histogram of
+// how long it took, and the store calls it made and the bytes they moved.
+// Everything is a relaxed atomic counter, so recording costs a handful of
+// uncontended additions and no lock. A handler starts with STATS_OP, which
+// times it until it returns; the store is called through the kv wrappers
+// below, which charge the handler running on the calling thread.
+enum statsOp {
+  OP_LOOKUP,
+  OP_FORGET,
+  OP_GETATTR,
+  OP_SETATTR,
+  OP_READDIR,
+  OP_MKDIR,
+  OP_RMDIR,
+  OP_OPEN,
+  OP_READ,
+  OP_CREATE,
+  OP_WRITE,
+  OP_UNLINK,
+  OP_FLUSH,
+  OP_RELEASE,
+  OP_FSYNC,
+  OP_RENAME,
+  OP_OPENDIR,
+  OP_RELEASEDIR,
+  OP_COUNT
+};
+
+static const char *statsOpNames[OP_COUNT] = {
+    "lookup", "forget", "getattr", "setattr", "readdir",
+    "mkdir",  "rmdir",  "open",    "read",    "create",
+    "write",  "unlink", "flush",   "release", "fsync",
+    "rename", "opendir", "releasedir",
+};
+
+struct opStats {
+  atomic_ullong calls;
+  atomic_ullong totalNs;
+  atomic_ullong maxNs;
+  atomic_ullong fetches;
+  atomic_ullong fetchBytes;
+  atomic_ullong stores;
+  atomic_ullong storeBytes;
+  atomic_ullong deletes;
+  atomic_ullong buckets[STATS_BUCKETS];
+};
+
+static struct opStats opStats[OP_COUNT];
+
+// The operation the handler on this thread is timing, if any.
+static _Thread_local struct opStats *statsCurrent;
+
+struct statsTimer {
+  struct opStats *op;
+  struct timespec start;
+};
+
+#define STATS_OP(op)                                                           \
+  struct statsTimer statsTimer __attribute__((cleanup(statsEnd))) =          \
+      statsBegin(op)
+
+#define statsAdd(counter, n)                                                   \
+  atomic_fetch_add_explicit(&(counter), (n), memory_order_relaxed)
+
+// The histogram bucket of a latency of 'ns' nanoseconds.
+static unsigned statsBucket(uint64_t ns) {
+  if (ns < (1 << STATS_SUB_BITS))
+    return ns;
+  unsigned shift = 63 - __builtin_clzll(ns) - STATS_SUB_BITS;
+  unsigned b = ((shift + 1) << STATS_SUB_BITS) +
+               ((ns >> shift) & ((1 << STATS_SUB_BITS) - 1));
+  return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+// The lowest latency counted in bucket 'b'; the bucket ends where b + 1
+// starts.
+static uint64_t statsBucketStart(unsigned b) {
+  if (b < (1 << STATS_SUB_BITS))
+    return b;
+  unsigned shift = (b >> STATS_SUB_BITS) - 1;
+  uint64_t sub = b & ((1 << STATS_SUB_BITS) - 1);
+  return ((1 << STATS_SUB_BITS) + sub) << shift;
+}
+
+static uint64_t statsNow(struct timespec *ts) {
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+// Start timing the operation 'op'. A handler called by another one, as
+// write is by write_buf, is part of its caller's time.
+static struct statsTimer statsBegin(enum statsOp op) {
+  struct statsTimer t = {NULL};
+  if (statsCurrent == NULL) {
+    t.op = statsCurrent = &opStats[op];
+    statsNow(&t.start);
+  }
+  return t;
+}
+
+static void statsEnd(struct statsTimer *t) {
+  if (t->op == NULL)
+    return;
+  struct timespec now;
+  uint64_t ns = statsNow(&now) - ((uint64_t)t->start.tv_sec * 1000000000 +
+                                  t->start.tv_nsec);
+  statsAdd(t->op->calls, 1);
+  statsAdd(t->op->totalNs, ns);
+  statsAdd(t->op->buckets[statsBucket(ns)], 1);
+  unsigned long long max = atomic_load_explicit(&t->op->maxNs,
+                                                memory_order_relaxed);
+  while (ns > max && !atomic_compare_exchange_weak_explicit(
+                         &t->op->maxNs, &max, ns, memory_order_relaxed,
+                         memory_order_relaxed))
+    ;
+  statsCurrent = NULL;
+}
+
+// unqlite_kv_fetch, counted.
+static int kvFetch(const void *key, int keyLen, void *buf,
+                   unqlite_int64 *bufLen) {
+  int rc = unqlite_kv_fetch(pDb, key, keyLen, buf, bufLen);
+  if (statsCurrent != NULL) {
+    statsAdd(statsCurrent->fetches, 1);
+    if (rc == UNQLITE_OK && buf != NULL)
+      statsAdd(statsCurrent->fetchBytes, *bufLen);
+  }
+  return rc;
+}
+
+struct kvCallback {
+  int (*consumer)(const void *, unsigned int, void *);
+  void *arg;
+};
+
+static int kvCountPage(const void *data, unsigned int len, void *arg) {
+  struct kvCallback *cb = arg;
+  if (statsCurrent != NULL)
+    statsAdd(statsCurrent->fetchBytes, len);
+  return cb->consumer(data, len, cb->arg);
+}
+
+// unqlite_kv_fetch_callback, counted.
+static int kvFetchCallback(const void *key, int keyLen,
+                           int (*consumer)(const void *, unsigned int, void *),
+                           void *arg) {
+  struct kvCallback cb = {consumer, arg};
+  if (statsCurrent != NULL)
+    statsAdd(statsCurrent->fetches, 1);
+  return unqlite_kv_fetch_callback(pDb, key, keyLen, kvCountPage, &cb);
+}
+
+static void kvCountStore(int rc, unqlite_int64 len) {
+  if (statsCurrent != NULL) {
+    statsAdd(statsCurrent->stores, 1);
+    if (rc == UNQLITE_OK)
+      statsAdd(statsCurrent->storeBytes, len);
+  }
+}
+
+// unqlite_kv_store, counted. A store is charged to the batch as its data.
+static int kvStore(const void *key, int keyLen, const void *data,
+                   unqlite_int64 len) {
+  int rc = unqlite_kv_store(pDb, key, keyLen, data, len);
+  kvCountStore(rc, len);
+  if (rc == UNQLITE_OK)
+    txnDirty(len);
+  return rc;
+}
+
+// unqlite_kv_append, counted and charged to the batch as a store.
+static int kvAppend(const void *key, int keyLen, const void *data,
+                    unqlite_int64 len) {
+  int rc = unqlite_kv_append(pDb, key, keyLen, data, len);
+  kvCountStore(rc, len);
+  if (rc == UNQLITE_OK)
+    txnDirty(len);
+  return rc;
+}
+
+// unqlite_kv_delete, counted. A delete is charged to the batch as its key.
+static int kvDelete(const void *key, int keyLen) {
+  if (statsCurrent != NULL)
+    statsAdd(statsCurrent->deletes, 1);
+  int rc = unqlite_kv_delete(pDb, key, keyLen);
+  if (rc == UNQLITE_OK)
+    txnDirty(keyLen);
+  return rc;
+}
+
+static bool isRootUUID(const uuid_t uuid) {
+  return memcmp(uuid, ROOT_OBJECT_KEY, KEY_SIZE) == 0;
+}
+
+// FUSE runs handlers on many threads at once. UnQLite serialises calls on
+// pDb itself (it is built with UNQLITE_ENABLE_THREADS); on top of that every
+// file and directory has a reader/writer lock. A handler that changes an
+// FCB, a directory's entries or a file's data holds the lock of that inode
+// exclusively; one that only reads it holds it shared, so reads of any files
+// proceed in parallel. Paths are resolved without locks and the FCB is
+// fetched again once the lock is held.
+//
+// The locks are striped by uuid, so unrelated inodes may share one. An
+// operation that needs two (a directory and an entry in it) takes them with
+// inodeLockPair, which orders them and never takes a stripe twice; rename,
+// which needs up to four, uses inodeLockSet the same way.
+//
+// Each stripe also counts the FCB changes made under it. Lookups done
+// without the lock only cache their answer if the count has not moved in the
+// meantime, so a slow lookup cannot put a stale FCB into the dentry cache.
+static pthread_rwlock_t inodeLocks[INODE_LOCK_STRIPES];
+static atomic_ulong inodeGenerations[INODE_LOCK_STRIPES];
+
+// The root FCB is also kept in memory, guarded by its own mutex
+static pthread_mutex_t rootLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned inodeStripe(const uuid_t uuid) {
+  uint64_t hash;
+  memcpy(&hash, uuid + sizeof(hash), sizeof(hash));
+  return hash & (INODE_LOCK_STRIPES - 1);
+}
+
+static void initInodeLocks() {
+  for (int i = 0; i < INODE_LOCK_STRIPES; i++)
+    pthread_rwlock_init(&inodeLocks[i], NULL);
+}
+
+static void inodeLock(const uuid_t uuid, bool exclusive) {
+  pthread_rwlock_t *lock = &inodeLocks[inodeStripe(uuid)];
+  if (exclusive)
+    pthread_rwlock_wrlock(lock);
+  else
+    pthread_rwlock_rdlock(lock);
+}
+
+static void inodeUnlock(const uuid_t uuid) {
+  pthread_rwlock_unlock(&inodeLocks[inodeStripe(uuid)]);
+}
+
+// Lock two inodes exclusively, lowest stripe first.
+static void inodeLockPair(const uuid_t a, const uuid_t b) {
+  unsigned sa = inodeStripe(a), sb = inodeStripe(b);
+  pthread_rwlock_wrlock(&inodeLocks[sa < sb ? sa : sb]);
+  if (sa != sb)
+    pthread_rwlock_wrlock(&inodeLocks[sa < sb ? sb : sa]);
+}
+
+static void inodeUnlockPair(const uuid_t a, const uuid_t b) {
+  unsigned sa = inodeStripe(a), sb = inodeStripe(b);
+  pthread_rwlock_unlock(&inodeLocks[sa]);
+  if (sa != sb)
+    pthread_rwlock_unlock(&inodeLocks[sb]);
+}
+
+// Lock 'count' inodes exclusively, lowest stripe first and each stripe once.
+// The stripes taken are left in 'stripes', which has room for 'count', for
+// inodeUnlockSet; returns how many there are.
+static int inodeLockSet(const unsigned char *uuids[], int count,
+                        unsigned *stripes) {
+  int n = 0;
+  for (int i = 0; i < count; i++) {
+    unsigned s = inodeStripe(uuids[i]);
+    int j = 0;
+    while (j < n && stripes[j] < s)
+      j++;
+    if (j < n && stripes[j] == s)
+      continue;
+    memmove(&stripes[j + 1], &stripes[j], (n - j) * sizeof(*stripes));
+    stripes[j] = s;
+    n++;
+  }
+  for (int i = 0; i < n; i++)
+    pthread_rwlock_wrlock(&inodeLocks[stripes[i]]);
+  return n;
+}
+
+static void inodeUnlockSet(const unsigned *stripes, int n) {
+  for (int i = 0; i < n; i++)
+    pthread_rwlock_unlock(&inodeLocks[stripes[i]]);
+}
+
+static unsigned long inodeGeneration(const uuid_t uuid) {
+  return atomic_load(&inodeGenerations[inodeStripe(uuid)]);
+}
+
+static void inodeChanged(const uuid_t uuid) {
+  atomic_fetch_add(&inodeGenerations[inodeStripe(uuid)], 1);
+}
+
+// Copy the in-memory root FCB.
+static void rootFCB(myfcb *fcb) {
+  pthread_mutex_lock(&rootLock);
+  *fcb = the_root_fcb;
+  pthread_mutex_unlock(&rootLock);
+}
+
+// 64 bit FNV-1a hash of a name, used to key the directory name index.
+static uint64_t nameHash(const char *name) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+    hash ^= *p;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// The dentry cache remembers recently resolved (parent uuid, name) pairs
+// together with the child's uuid and FCB, so path resolution of hot paths
+// never reaches the store. Every dentry is on two hash chains, one keyed by
+// (parent, name) for lookups and one keyed by the child's uuid so that
+// storeFCB can keep the cached FCB current, and on an LRU list that bounds
+// the cache to DCACHE_MAX_ENTRIES.
+//
+// Negative dentries remember names that were looked up and do not exist, so
+// repeated probes for missing files stop at the cache too. They have no child
+// and are not on the child chain. mkdir and create replace the negative
+// dentry of the name they add.
+typedef struct _dentry {
+  uuid_t parent;
+  uuid_t child;
+  myfcb fcb;
+  unsigned long gen; // generation of the child 'fcb' is current as of
+  bool negative;
+  struct _dentry *nameNext;
+  struct _dentry *childNext;
+  struct _dentry *lruPrev;
+  struct _dentry *lruNext;
+  char name[];
+} dentry;
+
+static dentry *dcacheByName[DCACHE_BUCKETS];
+static dentry *dcacheByChild[DCACHE_BUCKETS];
+static dentry *dcacheLruHead; // most recently used
+static dentry *dcacheLruTail;
+static int dcacheEntries;
+static pthread_mutex_t dcacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+// How often the cache answered a lookup. A positive hit saves an index fetch
+// and an FCB fetch, a negative hit saves the index fetch.
+static struct {
+  uint64_t hits;
+  uint64_t negativeHits;
+  uint64_t misses;
+} dcacheStats;
+
+enum { DCACHE_MISS, DCACHE_HIT, DCACHE_NEGATIVE };
+
+static unsigned dcacheNameSlot(const uuid_t parent, const char *name) {
+  uint64_t parentHash;
+  memcpy(&parentHash, parent, sizeof(parentHash));
+  return (nameHash(name) ^ parentHash) & (DCACHE_BUCKETS - 1);
+}
+
+static unsigned dcacheChildSlot(const uuid_t child) {
+  uint64_t childHash;
+  memcpy(&childHash, child + sizeof(childHash), sizeof(childHash));
+  return childHash & (DCACHE_BUCKETS - 1);
+}
+
+static dentry *dcacheFind(const uuid_t parent, const char *name) {
+  dentry *d = dcacheByName[dcacheNameSlot(parent, name)];
+  while (d != NULL &&
+         (memcmp(d->parent, parent, KEY_SIZE) != 0 || strcmp(d->name, name)))
+    d = d->nameNext;
+  return d;
+}
+
+static void dcacheLruUnlink(dentry *d) {
+  if (d->lruPrev != NULL)
+    d->lruPrev->lruNext = d->lruNext;
+  else
+    dcacheLruHead = d->lruNext;
+  if (d->lruNext != NULL)
+    d->lruNext->lruPrev = d->lruPrev;
+  else
+    dcacheLruTail = d->lruPrev;
+}
+
+static void dcacheLruPush(dentry *d) {
+  d->lruPrev = NULL;
+  d->lruNext = dcacheLruHead;
+  if (dcacheLruHead != NULL)
+    dcacheLruHead->lruPrev = d;
+  dcacheLruHead = d;
+  if (dcacheLruTail == NULL)
+    dcacheLruTail = d;
+}
+
+static void dcacheDrop(dentry *d) {
+  dentry **p = &dcacheByName[dcacheNameSlot(d->parent, d->name)];
+  while (*p != d)
+    p = &(*p)->nameNext;
+  *p = d->nameNext;
+  if (!d->negative) {
+    p = &dcacheByChild[dcacheChildSlot(d->child)];
+    while (*p != d)
+      p = &(*p)->childNext;
+    *p = d->childNext;
+  }
+  dcacheLruUnlink(d);
+  dcacheEntries--;
+  free(d);
+}
+
+// Look (parent, name) up. Returns DCACHE_HIT with the child's uuid and FCB,
+// and the generation of the child that FCB is current as of, copied out,
+// DCACHE_NEGATIVE if the name is known not to exist, or DCACHE_MISS.
+static int dcacheLookup(const uuid_t parent, const char *name, uuid_t child,
+                        myfcb *fcb, unsigned long *gen) {
+  int result = DCACHE_MISS;
+  pthread_mutex_lock(&dcacheLock);
+  dentry *d = dcacheFind(parent, name);
+  if (d == NULL) {
+    dcacheStats.misses++;
+  } else {
+    if (d->negative) {
+      dcacheStats.negativeHits++;
+      result = DCACHE_NEGATIVE;
     } else {
-      int count = (value.size) / sizeof(dirent);
-      // if the root directory does not contain any files;
-      if (count == 0) {
-        return -ENOENT;
-      }
-      dirent dirValue[count];
-      nBytes = sizeof(dirent) * count;
-      result = unqlite_kv_fetch(pDb, value.file_data_id, KEY_SIZE, dirValue,
-                                &nBytes);
-      if (result != UNQLITE_OK)
-        return -ENOENT;
-
-      bool found = false;
-      int index;
-      for (int i = 0; i < count; i++) {
-        if (strcmp(dirValue[i].name, token) == 0) {
-          found = true;
-          index = i;
-          token = strtok(NULL, "/");
-          break;
-        }
-      }
-      if (!found)
-        return -ENOENT;
-      nBytes = sizeof(myfcb);
-      result = unqlite_kv_fetch(pDb, dirValue[index].referencedFCB, KEY_SIZE,
-                                &value, &nBytes);
+      dcacheStats.hits++;
+      uuid_copy(child, d->child);
+      *fcb = d->fcb;
+      *gen = d->gen;
+      result = DCACHE_HIT;
     }
+    dcacheLruUnlink(d);
+    dcacheLruPush(d);
   }
+  pthread_mutex_unlock(&dcacheLock);
+  return result;
+}
 
-  *returnFCB = value;
-  return 0;
+// Add a dentry, replacing any for the same name. Called with dcacheLock held.
+static void dcacheAdd(const uuid_t parent, const char *name,
+                      const uuid_t child, const myfcb *fcb,
+                      unsigned long gen) {
+  dentry *d = dcacheFind(parent, name);
+  if (d != NULL)
+    dcacheDrop(d);
+  d = malloc(sizeof(dentry) + strlen(name) + 1);
+  if (d != NULL) {
+    uuid_copy(d->parent, parent);
+    strcpy(d->name, name);
+    unsigned slot = dcacheNameSlot(parent, name);
+    d->nameNext = dcacheByName[slot];
+    dcacheByName[slot] = d;
+    d->negative = child == NULL;
+    if (!d->negative) {
+      uuid_copy(d->child, child);
+      d->fcb = *fcb;
+      d->gen = gen;
+      slot = dcacheChildSlot(child);
+      d->childNext = dcacheByChild[slot];
+      dcacheByChild[slot] = d;
+    }
+    dcacheLruPush(d);
+    if (++dcacheEntries > DCACHE_MAX_ENTRIES)
+      dcacheDrop(dcacheLruTail);
+  }
 }
 
-// The functions which follow are handler functions for various things a
-// filesystem needs to do:
-// reading, getting attributes, truncating, etc. They will be called by FUSE
-// whenever it needs
-// your filesystem to do something, so this is where functionality goes.
+// Remember that 'name' in 'parent' is 'child' with FCB 'fcb', or that it does
+// not exist if 'child' is NULL. The caller holds the lock of 'parent', and of
+// 'child' unless no one else knows it yet.
+static void dcacheInsert(const uuid_t parent, const char *name,
+                         const uuid_t child, const myfcb *fcb) {
+  pthread_mutex_lock(&dcacheLock);
+  dcacheAdd(parent, name, child, fcb, child ? inodeGeneration(child) : 0);
+  pthread_mutex_unlock(&dcacheLock);
+}
 
-// Get file and directory attributes (meta-data).
-// Read 'man 2 stat' and 'man 2 chmod'.
-static int myfs_getattr(const char *path, struct stat *stbuf) {
+// As dcacheInsert, for an answer read without holding any lock: it is only
+// cached if neither 'parent' nor 'child' has changed since their generations
+// were sampled as 'parentGen' and 'childGen'.
+static void dcacheInsertUnchanged(const uuid_t parent, const char *name,
+                                  const uuid_t child, const myfcb *fcb,
+                                  unsigned long parentGen,
+                                  unsigned long childGen) {
+  pthread_mutex_lock(&dcacheLock);
+  if (inodeGeneration(parent) == parentGen &&
+      (child == NULL || inodeGeneration(child) == childGen))
+    dcacheAdd(parent, name, child, fcb, childGen);
+  pthread_mutex_unlock(&dcacheLock);
+}
 
-  write_log("myfs_getattr(path=\"%s\", statbuf=0x%08x)\n", path, stbuf);
+// Forget 'name' in 'parent', e.g. because it has been removed.
+static void dcacheRemove(const uuid_t parent, const char *name) {
+  pthread_mutex_lock(&dcacheLock);
+  dentry *d = dcacheFind(parent, name);
+  if (d != NULL)
+    dcacheDrop(d);
+  pthread_mutex_unlock(&dcacheLock);
+}
 
-  memset(stbuf, 0, sizeof(struct stat));
-  if (strcmp(path, "/") == 0) {
-    // conceptually the root
-    stbuf->st_mode = the_root_fcb.mode;
-    stbuf->st_nlink = 2;
-    stbuf->st_uid = the_root_fcb.uid;
-    stbuf->st_gid = the_root_fcb.gid;
-    stbuf->st_mtime = the_root_fcb.mtime;
-    stbuf->st_ctime = the_root_fcb.ctime;
-    stbuf->st_size = the_root_fcb.size;
-  } else {
+// The FCB stored under 'child' has changed: refresh the cached copy.
+static void dcacheUpdateFCB(const uuid_t child, const myfcb *fcb) {
+  pthread_mutex_lock(&dcacheLock);
+  unsigned long gen = inodeGeneration(child);
+  for (dentry *d = dcacheByChild[dcacheChildSlot(child)]; d != NULL;
+       d = d->childNext) {
+    if (memcmp(d->child, child, KEY_SIZE) == 0) {
+      d->fcb = *fcb;
+      d->gen = gen;
+    }
+  }
+  pthread_mutex_unlock(&dcacheLock);
+}
+
+// Print the hit counters, e.g. to the log on unmount.
+static void dcacheReport(FILE *out) {
+  pthread_mutex_lock(&dcacheLock);
+  fprintf(out,
+          "dcache: %llu hits, %llu negative hits, %llu misses, "
+          "%llu store fetches saved\n",
+          (unsigned long long)dcacheStats.hits,
+          (unsigned long long)dcacheStats.negativeHits,
+          (unsigned long long)dcacheStats.misses,
+          (unsigned long long)(2 * dcacheStats.hits +
+                               dcacheStats.negativeHits));
+  pthread_mutex_unlock(&dcacheLock);
+}
+
+// Files that are open. Every open of the same file shares one openfile, which
+// FUSE hands back to us in fi->fh. storeFCB keeps the FCB of an open file
+// current.
+//
+// A file that is unlinked while open keeps its FCB and data until the last
+// release, like any Unix filesystem.
+//
+// An open file also carries the write-back buffer of the file (see
+// WRITEBACK_MAX): 'dirtyLen' bytes written at 'dirtyOff' that the store has
+// not seen yet. The buffer belongs to whoever holds the inode lock, and
+// release takes that lock before dropping its reference, so an openfile found
+// under the inode lock stays valid until it is unlocked. 'dirtyEnd' is the
+// size the file has with the buffer applied, 0 when there is none, for stat
+// without the lock.
+typedef struct _openfile {
+  uuid_t uuid;
+  myfcb fcb;
+  int refs;
+  bool unlinked;
+  char *dirty;
+  off_t dirtyOff;
+  size_t dirtyLen;
+  atomic_llong dirtyEnd;
+  struct _openfile *next;
+} openfile;
+
+static openfile *openFiles[OPENFILE_BUCKETS];
+static pthread_mutex_t openFilesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned openfileSlot(const uuid_t uuid) {
+  uint64_t hash;
+  memcpy(&hash, uuid + sizeof(hash), sizeof(hash));
+  return hash & (OPENFILE_BUCKETS - 1);
+}
+
+static openfile *openfileFind(const uuid_t uuid) {
+  openfile *of = openFiles[openfileSlot(uuid)];
+  while (of != NULL && memcmp(of->uuid, uuid, KEY_SIZE) != 0)
+    of = of->next;
+  return of;
+}
+
+// Take a reference on the open file for 'uuid', opening it if need be.
+static openfile *openfileGet(const uuid_t uuid, const myfcb *fcb) {
+  pthread_mutex_lock(&openFilesLock);
+  openfile *of = openfileFind(uuid);
+  if (of == NULL && (of = calloc(1, sizeof(openfile))) != NULL) {
+    uuid_copy(of->uuid, uuid);
+    of->fcb = *fcb;
+    unsigned slot = openfileSlot(uuid);
+    of->next = openFiles[slot];
+    openFiles[slot] = of;
+  }
+  if (of != NULL)
+    of->refs++;
+  pthread_mutex_unlock(&openFilesLock);
+  return of;
+}
+
+// Drop a reference. Returns true if it was the last one of a file that has
+// been unlinked, in which case the caller deletes the file and frees 'of'.
+static bool openfilePut(openfile *of) {
+  bool last = false;
+  pthread_mutex_lock(&openFilesLock);
+  if (--of->refs == 0) {
+    openfile **p = &openFiles[openfileSlot(of->uuid)];
+    while (*p != of)
+      p = &(*p)->next;
+    *p = of->next;
+    last = true;
+  }
+  pthread_mutex_unlock(&openFilesLock);
+  if (last && !of->unlinked) {
+    free(of);
+    return false;
+  }
+  return last;
+}
+
+// The file 'uuid' is being unlinked. Returns true if it is open, in which
+// case deleting it is left to the last release.
+static bool openfileUnlink(const uuid_t uuid) {
+  pthread_mutex_lock(&openFilesLock);
+  openfile *of = openfileFind(uuid);
+  if (of != NULL)
+    of->unlinked = true;
+  pthread_mutex_unlock(&openFilesLock);
+  return of != NULL;
+}
+
+static void openfileUpdateFCB(const uuid_t uuid, const myfcb *fcb) {
+  pthread_mutex_lock(&openFilesLock);
+  openfile *of = openfileFind(uuid);
+  if (of != NULL)
+    of->fcb = *fcb;
+  pthread_mutex_unlock(&openFilesLock);
+}
+
+#define FI_OPENFILE(fi) ((openfile *)(uintptr_t)(fi)->fh)
+
+// The open file of 'uuid', if any. The caller holds the lock of 'uuid'.
+static openfile *openfileOf(const uuid_t uuid) {
+  pthread_mutex_lock(&openFilesLock);
+  openfile *of = openfileFind(uuid);
+  pthread_mutex_unlock(&openFilesLock);
+  return of;
+}
+
+// Size of the file 'uuid' with its write-back buffer applied, or 0 if it has
+// none.
+static off_t openfileDirtyEnd(const uuid_t uuid) {
+  pthread_mutex_lock(&openFilesLock);
+  openfile *of = openfileFind(uuid);
+  off_t end = of != NULL ? atomic_load(&of->dirtyEnd) : 0;
+  pthread_mutex_unlock(&openFilesLock);
+  return end;
+}
+
+// Bytes held by the write-back buffers of all open files.
+static atomic_size_t writebackBytes;
+
+// Drop the write-back buffer of 'of'.
+static void dropDirty(openfile *of) {
+  if (of->dirty == NULL)
+    return;
+  free(of->dirty);
+  of->dirty = NULL;
+  of->dirtyLen = 0;
+  atomic_store(&of->dirtyEnd, 0);
+  atomic_fetch_sub(&writebackBytes, WRITEBACK_MAX);
+}
 
-    myfcb curr;
-    memset(&curr, 0, sizeof(myfcb));
-    int res = getFCBFromPath(path, &curr);
-    if (res < 0) {
-      write_log("Stat did not find %s ", path);
-      return -ENOENT;
+// Add a write of 'size' bytes at 'offset' to the write-back buffer of 'of',
+// whose stored size is 'storedSize'. Returns false, leaving the buffer alone,
+// if the write is too big, does not continue the buffered range or would take
+// a new buffer past WRITEBACK_LIMIT. The caller holds the inode lock
+// exclusively.
+static bool bufferWrite(openfile *of, off_t storedSize, const char *buf,
+                        size_t size, off_t offset) {
+  if (size >= WRITEBACK_MAX)
+    return false;
+  if (of->dirty == NULL) {
+    if (atomic_fetch_add(&writebackBytes, WRITEBACK_MAX) + WRITEBACK_MAX >
+            WRITEBACK_LIMIT ||
+        (of->dirty = malloc(WRITEBACK_MAX)) == NULL) {
+      atomic_fetch_sub(&writebackBytes, WRITEBACK_MAX);
+      return false;
     }
-    write_log("Stat found: %s ", path);
-    // if (curr.name)
-    stbuf->st_mode = curr.mode;
-    stbuf->st_nlink = 1;
-    stbuf->st_mtime = curr.mtime;
-    stbuf->st_ctime = curr.ctime;
-    stbuf->st_size = curr.size;
-    stbuf->st_uid = curr.uid;
-    stbuf->st_gid = curr.gid;
-    // }else{
-    // write_log("myfs_getattr - ENOENT");
-    // return 0;
-    // }
+    of->dirtyOff = offset;
+    of->dirtyLen = 0;
+  } else if (offset < of->dirtyOff ||
+             offset > of->dirtyOff + (off_t)of->dirtyLen ||
+             offset + size - of->dirtyOff > WRITEBACK_MAX) {
+    return false;
   }
-  return 0;
+  size_t within = offset - of->dirtyOff;
+  memcpy(of->dirty + within, buf, size);
+  if (within + size > of->dirtyLen)
+    of->dirtyLen = within + size;
+  off_t end = of->dirtyOff + of->dirtyLen;
+  atomic_store(&of->dirtyEnd, end > storedSize ? end : storedSize);
+  return true;
 }
 
-int getParentUUID(uuid_t *uuid, const char *path) {
-  char copy[strlen(path) + 1];
-  strcpy(copy, path);
-
-  char *parentDir = dirname(copy);
-  char parentCpy[strlen(parentDir) + 1];
-  strcpy(parentCpy, parentDir);
-  char *parentName = basename(parentCpy);
-  write_log("Parent Name is %s \n",parentName);
-  char *parentDirOfParentDir = dirname(parentDir);
-  write_log("Parents Parent is %s \n",parentDirOfParentDir);
-  if (strcmp(parentName,"/") == 0) {
-    // TOFIX
-    write_log("get Parent UUID copies the root Object key %s \n", ROOT_OBJECT_KEY);
-    uuid_copy(*uuid, ROOT_OBJECT_KEY);
-    write_log("New Root Object is %s\n",*uuid);
+// Copy whatever part of the write-back buffer of 'of' overlaps the 'size'
+// bytes at 'offset' over 'buf', which holds those bytes as stored.
+static void readDirty(const openfile *of, char *buf, size_t size,
+                      off_t offset) {
+  if (of == NULL || of->dirtyLen == 0)
+    return;
+  off_t from = offset > of->dirtyOff ? offset : of->dirtyOff;
+  off_t to = of->dirtyOff + (off_t)of->dirtyLen;
+  if (to > offset + (off_t)size)
+    to = offset + size;
+  if (from < to)
+    memcpy(buf + (from - offset), of->dirty + (from - of->dirtyOff),
+           to - from);
+}
+
+// Inodes the kernel knows about. FUSE names files and directories by inode
+// number rather than by path. Ours is the first 8 bytes of the uuid the FCB
+// is stored under, so it stays the same from one mount to the next and
+// readdir can report it without a lookup. The table maps a number back to
+// its uuid and keeps a copy of the FCB, which storeRecord keeps current, so
+// most operations on an inode cost no fetch at all.
+//
+// An inode stays in the table while the kernel holds lookup references on
+// it: every entry we reply with takes one, and forget drops them. A lookup
+// reads the FCB without the inode's lock, though, and a forget and a change
+// can both come in before it is added: an inode is only added with an FCB
+// that is current as of its generation (see itableGet). The root has no
+// entry: it is FUSE_ROOT_ID, and its FCB is the_root_fcb.
+typedef struct _itableEntry {
+  fuse_ino_t ino;
+  uuid_t uuid;
+  myfcb fcb;
+  uint64_t nlookup;
+  struct _itableEntry *next;
+} itableEntry;
+
+static itableEntry *itable[ITABLE_BUCKETS];
+static pthread_mutex_t itableLock = PTHREAD_MUTEX_INITIALIZER;
+
+// The inode number of the FCB stored under 'uuid'.
+static fuse_ino_t uuidIno(const uuid_t uuid) {
+  if (isRootUUID(uuid))
+    return FUSE_ROOT_ID;
+  uint64_t ino;
+  memcpy(&ino, uuid, sizeof(ino));
+  return ino;
+}
+
+static itableEntry *itableFind(fuse_ino_t ino) {
+  itableEntry *e = itable[ino & (ITABLE_BUCKETS - 1)];
+  while (e != NULL && e->ino != ino)
+    e = e->next;
+  return e;
+}
+
+// Take a lookup reference on the inode of 'uuid', whose FCB is 'fcb', adding
+// it to the table if need be, and return its number in '*ino'. 'fcb' was
+// current as of the generation 'gen' of the inode. Read without its lock, it
+// may be out of date if the inode changed while out of the table: then it is
+// not added and -EAGAIN tells the caller to fetch the FCB again.
+static int itableGet(const uuid_t uuid, const myfcb *fcb, unsigned long gen,
+                     fuse_ino_t *ino) {
+  *ino = uuidIno(uuid);
+  if (*ino == FUSE_ROOT_ID)
     return 0;
+  int rc = 0;
+  pthread_mutex_lock(&itableLock);
+  itableEntry *e = itableFind(*ino);
+  if (e != NULL && uuid_compare(e->uuid, uuid) != 0) {
+    log_error("inode number %lu is taken by another uuid\n",
+              (unsigned long)*ino);
+    rc = -EIO;
+  } else if (e == NULL && inodeGeneration(uuid) != gen) {
+    rc = -EAGAIN;
+  } else if (e == NULL && (e = calloc(1, sizeof(itableEntry))) == NULL) {
+    rc = -ENOMEM;
+  } else if (e->nlookup == 0) {
+    e->ino = *ino;
+    uuid_copy(e->uuid, uuid);
+    e->fcb = *fcb;
+    unsigned slot = *ino & (ITABLE_BUCKETS - 1);
+    e->next = itable[slot];
+    itable[slot] = e;
   }
-  myfcb parParFCB;
-  int result = 0;
-  int retVal = getFCBFromPath(parentDirOfParentDir, &parParFCB);
-  if (retVal < 0)
-    return -1;
-  int count = (parParFCB.size) / sizeof(dirent);
-  // if the root directory does not contain any files;
-  if (count == 0) {
-    return -ENOENT;
-  }
-  unqlite_int64 nBytes = parParFCB.size;
-  dirent dirValue[count];
-  nBytes = sizeof(dirent) * count;
-  result = unqlite_kv_fetch(pDb, parParFCB.file_data_id, KEY_SIZE, dirValue,
-                            &nBytes);
-  if (result != UNQLITE_OK)
-    return -ENOENT;
+  if (rc == 0)
+    e->nlookup++;
+  pthread_mutex_unlock(&itableLock);
+  return rc;
+}
 
-  for (int i = 0; i < count; i++) {
-    if (strcmp(dirValue[i].name, parentName) == 0) {
-      uuid_copy(*uuid, dirValue[i].referencedFCB);
-      return 0;
+// Drop 'nlookup' lookup references on 'ino', forgetting it once none are
+// left.
+static void itableForget(fuse_ino_t ino, uint64_t nlookup) {
+  if (ino == FUSE_ROOT_ID)
+    return;
+  pthread_mutex_lock(&itableLock);
+  itableEntry *e = itableFind(ino);
+  if (e != NULL) {
+    e->nlookup = e->nlookup > nlookup ? e->nlookup - nlookup : 0;
+    if (e->nlookup == 0) {
+      itableEntry **p = &itable[ino & (ITABLE_BUCKETS - 1)];
+      while (*p != e)
+        p = &(*p)->next;
+      *p = e->next;
+      free(e);
     }
   }
-  return -1;
+  pthread_mutex_unlock(&itableLock);
 }
 
-// Create a directory.
-// Read 'man 2 mkdir'.
-int myfs_mkdir(const char *path, mode_t mode) {
-  write_log("myfs_mkdir: %s\n", path);
-  bool isRoot = false;
-  char copy[strlen(path) + 1];
-  strcpy(copy, path);
-  mode |= S_IFDIR;
-  int rc;
-  uuid_t parUUID;
-  unqlite_int64 nBytes = sizeof(myfcb);
-  char *name = basename(copy);
-  strcpy(copy, path);
-  rc = getParentUUID(&parUUID, path);
-  write_log("mkdir GETS THE PARENT UUID the parent uuid is %s\n",parUUID);
-  // if (rc ==5)
-  if (rc < 0) {
+// Whether 'ino' is the statistics directory or file, which have no FCB.
+static bool isStatsIno(fuse_ino_t ino) {
+  return ino == STATS_DIR_INO || ino == STATS_FILE_INO;
+}
+
+// Get the uuid of the inode 'ino' and, if 'fcb' is not NULL, its FCB. The
+// statistics inodes have none, so every handler that goes through here
+// refuses them.
+static int itableLookup(fuse_ino_t ino, uuid_t uuid, myfcb *fcb) {
+  if (isStatsIno(ino))
+    return -EACCES;
+  if (ino == FUSE_ROOT_ID) {
+    memcpy(uuid, ROOT_OBJECT_KEY, KEY_SIZE);
+    if (fcb != NULL)
+      rootFCB(fcb);
+    return 0;
+  }
+  pthread_mutex_lock(&itableLock);
+  itableEntry *e = itableFind(ino);
+  if (e != NULL) {
+    uuid_copy(uuid, e->uuid);
+    if (fcb != NULL)
+      *fcb = e->fcb;
+  }
+  pthread_mutex_unlock(&itableLock);
+  return e != NULL ? 0 : -ESTALE;
+}
+
+static void itableUpdateFCB(const uuid_t uuid, const myfcb *fcb) {
+  pthread_mutex_lock(&itableLock);
+  itableEntry *e = itableFind(uuidIno(uuid));
+  if (e != NULL && uuid_compare(e->uuid, uuid) == 0)
+    e->fcb = *fcb;
+  pthread_mutex_unlock(&itableLock);
+}
+
+// Whether the data of the file described by 'fcb' lives in its FCB record.
+static bool isInline(const myfcb *fcb) {
+  return !S_ISDIR(fcb->mode) && fcb->size <= INLINE_DATA_MAX;
+}
+
+// Number of data bytes kept in the FCB record of 'fcb'.
+static size_t inlineLength(const myfcb *fcb) {
+  return isInline(fcb) ? fcb->size : 0;
+}
+
+// Fetch the FCB record stored under 'uuid'. If 'data' is not NULL the inline
+// data of a small file is copied into it too; it must hold INLINE_DATA_MAX
+// bytes.
+static int fetchRecord(const uuid_t uuid, myfcb *fcb, char *data) {
+  char record[sizeof(myfcb) + INLINE_DATA_MAX];
+  unqlite_int64 nBytes = sizeof(record);
+  int rc = kvFetch(uuid, KEY_SIZE, record, &nBytes);
+  if (rc == UNQLITE_NOTFOUND)
     return -ENOENT;
+  if (rc != UNQLITE_OK || nBytes < sizeof(myfcb))
+    return -EIO;
+  memcpy(fcb, record, sizeof(myfcb));
+  if (nBytes != sizeof(myfcb) + inlineLength(fcb))
+    return -EIO;
+  if (data != NULL)
+    memcpy(data, record + sizeof(myfcb), inlineLength(fcb));
+  return 0;
+}
+
+// Fetch the FCB stored under 'uuid'.
+static int fetchFCB(const uuid_t uuid, myfcb *fcb) {
+  return fetchRecord(uuid, fcb, NULL);
+}
+
+// Store the FCB record under 'uuid': 'fcb' followed, for a small file, by
+// its contents from 'data'. The in-memory copies of the FCB are kept up to
+// date. The caller holds the lock of 'uuid' exclusively.
+static int storeRecord(const uuid_t uuid, const myfcb *fcb, const char *data) {
+  size_t len = inlineLength(fcb);
+  char record[sizeof(myfcb) + len];
+  memcpy(record, fcb, sizeof(myfcb));
+  if (len > 0)
+    memcpy(record + sizeof(myfcb), data, len);
+  if (kvStore(uuid, KEY_SIZE, record, sizeof(record)) != UNQLITE_OK)
+    return -EIO;
+  inodeChanged(uuid);
+  if (isRootUUID(uuid)) {
+    pthread_mutex_lock(&rootLock);
+    the_root_fcb = *fcb;
+    pthread_mutex_unlock(&rootLock);
   }
-  bool updateCacheRoot = false;
-  if (uuid_compare(parUUID,ROOT_OBJECT_KEY) ==0){
-    updateCacheRoot =true;
+  dcacheUpdateFCB(uuid, fcb);
+  openfileUpdateFCB(uuid, fcb);
+  itableUpdateFCB(uuid, fcb);
+  return 0;
+}
+
+// Store a changed FCB under 'uuid' whose file size is unchanged. A small
+// file's data is carried over from the stored record.
+static int storeFCB(const uuid_t uuid, const myfcb *fcb) {
+  if (inlineLength(fcb) == 0)
+    return storeRecord(uuid, fcb, NULL);
+  myfcb stored;
+  char data[INLINE_DATA_MAX];
+  int rc = fetchRecord(uuid, &stored, data);
+  if (rc < 0)
+    return rc;
+  if (stored.size != fcb->size)
+    return -EIO;
+  return storeRecord(uuid, fcb, data);
+}
+
+// Build the index key of 'name' in the directory whose FCB is stored under
+// 'dirUUID'.
+static void indexKey(const uuid_t dirUUID, const char *name,
+                     unsigned char *key) {
+  uint64_t hash = nameHash(name);
+  memcpy(key, dirUUID, KEY_SIZE);
+  memcpy(key + KEY_SIZE, &hash, sizeof(hash));
+}
+
+// Fetch the index bucket under 'key'. Buckets nearly always hold a single
+// entry, so try a small buffer first and only ask for the real length when a
+// hash collision has made the bucket bigger. The caller frees '*bucket'.
+static int fetchBucket(const unsigned char *key, char **bucket,
+                       unqlite_int64 *len) {
+  *len = INDEX_BUCKET_GUESS;
+  *bucket = malloc(*len);
+  if (*bucket == NULL)
+    return -ENOMEM;
+  int rc = kvFetch(key, INDEX_KEY_SIZE, *bucket, len);
+  if (rc == UNQLITE_ABORT && *len == INDEX_BUCKET_GUESS) {
+    // Truncated: the bucket is bigger than our guess
+    rc = kvFetch(key, INDEX_KEY_SIZE, NULL, len);
+    if (rc == UNQLITE_OK) {
+      char *bigger = realloc(*bucket, *len);
+      if (bigger == NULL) {
+        free(*bucket);
+        return -ENOMEM;
+      }
+      *bucket = bigger;
+      rc = kvFetch(key, INDEX_KEY_SIZE, *bucket, len);
+    }
   }
-  myfcb parentFCB;
-  nBytes = sizeof(myfcb);
-  write_log("uuid is %s length of the key is %d nBytes is %d\n",parUUID,KEY_SIZE,nBytes );
-  rc = unqlite_kv_fetch(pDb, parUUID, KEY_SIZE, &parentFCB, &nBytes);
   if (rc != UNQLITE_OK) {
-    write_log("Fetch Seems to be failing\n");
-    return -1;
+    free(*bucket);
+    return rc == UNQLITE_NOTFOUND ? -ENOENT : -EIO;
   }
-  write_log("mkdir Fetches the Parent UUID \n");
+  return 0;
+}
 
-  // Size of 0 represents that the directory does not contain any values
-  myfcb newFCB;
-  uuid_copy(newFCB.file_data_id, zero_uuid);
-  newFCB.size = 0;
-  newFCB.ctime = time(NULL);
-  newFCB.mtime = time(NULL);
-  newFCB.mode = mode;
-  newFCB.uid = getuid();
-  newFCB.gid = getgid();
-  uuid_t uid;
-  uuid_generate(uid);
-  rc = unqlite_kv_store(pDb, uid, KEY_SIZE, &newFCB, sizeof(myfcb));
-  if (rc != UNQLITE_OK) {
-    return -1;
+// Find the entry for 'name' in a bucket. Returns its offset or -1.
+static long findInBucket(const char *bucket, unqlite_int64 len,
+                         const char *name) {
+  size_t nameLen = strlen(name);
+  unqlite_int64 pos = 0;
+  while (pos + INDEX_ENTRY_HEADER <= len) {
+    uint16_t entryLen;
+    memcpy(&entryLen, bucket + pos + INDEX_ENTRY_NAMELEN, sizeof(entryLen));
+    if (entryLen == nameLen &&
+        memcmp(bucket + pos + INDEX_ENTRY_HEADER, name, nameLen) == 0)
+      return pos;
+    pos += INDEX_ENTRY_HEADER + entryLen;
   }
-  write_log("mkdir stores the new FCB\n");
+  return -1;
+}
 
-  dirent newDirent;
-  strcpy(newDirent.name, name);
-  uuid_copy(newDirent.referencedFCB, uid);
+// Look 'name' up in the index of the directory stored under 'dirUUID'.
+static int indexLookup(const uuid_t dirUUID, const char *name,
+                       uuid_t childUUID) {
+  unsigned char key[INDEX_KEY_SIZE];
+  indexKey(dirUUID, name, key);
+  char *bucket;
+  unqlite_int64 len;
+  int rc = fetchBucket(key, &bucket, &len);
+  if (rc < 0)
+    return rc;
+  long pos = findInBucket(bucket, len, name);
+  if (pos >= 0)
+    memcpy(childUUID, bucket + pos, KEY_SIZE);
+  free(bucket);
+  return pos >= 0 ? 0 : -ENOENT;
+}
 
-  uuid_t direntUUID;
-  if (parentFCB.size == 0) {
-    uuid_generate(direntUUID);
-    uuid_copy(parentFCB.file_data_id, direntUUID);
-    if (updateCacheRoot == true){
-      uuid_copy(the_root_fcb.file_data_id,direntUUID);
-    }
+// Record 'name' -> 'childUUID', whose dirent is in segment 'segment', in the
+// index of the directory 'dirUUID'.
+static int indexInsert(const uuid_t dirUUID, const char *name,
+                       const uuid_t childUUID, uint32_t segment) {
+  unsigned char key[INDEX_KEY_SIZE];
+  indexKey(dirUUID, name, key);
+  uint16_t nameLen = strlen(name);
+  char entry[INDEX_ENTRY_HEADER + nameLen];
+  memcpy(entry, childUUID, KEY_SIZE);
+  memcpy(entry + INDEX_ENTRY_SEGMENT, &segment, sizeof(segment));
+  memcpy(entry + INDEX_ENTRY_NAMELEN, &nameLen, sizeof(nameLen));
+  memcpy(entry + INDEX_ENTRY_HEADER, name, nameLen);
+  if (kvAppend(key, INDEX_KEY_SIZE, entry, sizeof(entry)) != UNQLITE_OK)
+    return -EIO;
+  return 0;
+}
+
+// Drop 'name' from the index of the directory 'dirUUID', and get the segment
+// holding its dirent.
+static int indexRemove(const uuid_t dirUUID, const char *name,
+                       uint32_t *segment) {
+  unsigned char key[INDEX_KEY_SIZE];
+  indexKey(dirUUID, name, key);
+  char *bucket;
+  unqlite_int64 len;
+  int rc = fetchBucket(key, &bucket, &len);
+  if (rc < 0)
+    return rc;
+  long pos = findInBucket(bucket, len, name);
+  if (pos < 0) {
+    rc = -ENOENT;
   } else {
-    uuid_copy(direntUUID, parentFCB.file_data_id);
+    memcpy(segment, bucket + pos + INDEX_ENTRY_SEGMENT, sizeof(*segment));
+    size_t entryLen = INDEX_ENTRY_HEADER + strlen(name);
+    if (entryLen == len) {
+      if (kvDelete(key, INDEX_KEY_SIZE) != UNQLITE_OK)
+        rc = -EIO;
+    } else {
+      memmove(bucket + pos, bucket + pos + entryLen, len - pos - entryLen);
+      if (kvStore(key, INDEX_KEY_SIZE, bucket, len - entryLen) != UNQLITE_OK)
+        rc = -EIO;
+    }
   }
+  free(bucket);
+  return rc;
+}
 
-  rc = unqlite_kv_append(pDb, direntUUID, KEY_SIZE, &newDirent, sizeof(dirent));
-  if (rc != UNQLITE_OK) {
+// Find 'name' in the directory stored under 'dirUUID' and fetch its FCB. The
+// answer comes from the dentry cache or else costs one index fetch and one FCB
+// fetch, however big the directory is. Either answer is cached. If 'gen' is
+// not NULL it is set to the generation of the child the FCB is current as of.
+static int lookupChild(const uuid_t dirUUID, const char *name, uuid_t child,
+                       myfcb *fcb, unsigned long *gen) {
+  unsigned long cachedGen;
+  int cached = dcacheLookup(dirUUID, name, child, fcb, &cachedGen);
+  if (cached == DCACHE_NEGATIVE)
     return -ENOENT;
+  if (cached == DCACHE_HIT) {
+    if (gen != NULL)
+      *gen = cachedGen;
+    return 0;
   }
+  unsigned long dirGen = inodeGeneration(dirUUID);
+  int rc = indexLookup(dirUUID, name, child);
+  if (rc == -ENOENT)
+    dcacheInsertUnchanged(dirUUID, name, NULL, NULL, dirGen, 0);
+  if (rc < 0)
+    return rc;
+  unsigned long childGen = inodeGeneration(child);
+  rc = fetchFCB(child, fcb);
+  if (rc < 0)
+    return rc;
+  dcacheInsertUnchanged(dirUUID, name, child, fcb, dirGen, childGen);
+  if (gen != NULL)
+    *gen = childGen;
+  return 0;
+}
 
-  parentFCB.size += sizeof(dirent);
-  if (isRoot) {
-    the_root_fcb.size += sizeof(dirent);
-  }
-  if (updateCacheRoot == true){
-    the_root_fcb.size += sizeof(dirent);
+// Lock the inode 'ino' and get the uuid its FCB is stored under and the
+// current FCB. On success the caller unlocks 'uuid'.
+static int lockInode(fuse_ino_t ino, bool exclusive, uuid_t uuid,
+                     myfcb *fcb) {
+  int rc = itableLookup(ino, uuid, NULL);
+  if (rc < 0)
+    return rc;
+  inodeLock(uuid, exclusive);
+  // The FCB only changes under the lock we now hold
+  rc = itableLookup(ino, uuid, fcb);
+  if (rc < 0)
+    inodeUnlock(uuid);
+  return rc;
+}
+
+// Build the key of chunk number 'index' of the file whose data lives under
+// 'dataId'.
+static void chunkKey(const uuid_t dataId, uint64_t index, unsigned char *key) {
+  memcpy(key, dataId, KEY_SIZE);
+  for (int i = 0; i < sizeof(uint64_t); i++) {
+    key[KEY_SIZE + i] = (index >> (8 * (sizeof(uint64_t) - 1 - i))) & 0xff;
   }
-  int retVal =
-      unqlite_kv_store(pDb, parUUID, KEY_SIZE, &parentFCB, sizeof(myfcb));
-  if (rc != UNQLITE_OK) {
-    return -ENOENT;
+}
+
+// A packed directory entry, pointing into the buffer it was read from.
+typedef struct {
+  const unsigned char *uuid;
+  uint64_t cookie;
+  mode_t type;
+  const char *name;
+  size_t nameLen;
+} packedDirent;
+
+// Size of the packed entry for a name of 'nameLen' bytes.
+static size_t direntSize(size_t nameLen) { return DIRENT_HEADER + nameLen; }
+
+// Length of the name of the packed entry starting at 'p'.
+static size_t direntNameLen(const char *p) {
+  return (unsigned char)p[DIRENT_HEADER - 1];
+}
+
+// Pack the entry 'name' -> 'childUUID', a file of mode 'mode', with readdir
+// cookie 'cookie' into 'out'. Returns its size.
+static size_t packDirent(char *out, const char *name, const uuid_t childUUID,
+                         uint64_t cookie, mode_t mode) {
+  size_t nameLen = strlen(name);
+  memcpy(out, childUUID, KEY_SIZE);
+  memcpy(out + KEY_SIZE, &cookie, sizeof(cookie));
+  out[DIRENT_HEADER - 2] = (mode & S_IFMT) >> 12;
+  out[DIRENT_HEADER - 1] = nameLen;
+  memcpy(out + DIRENT_HEADER, name, nameLen);
+  return direntSize(nameLen);
+}
+
+// Decode the entry at '*pos' of the 'len' bytes of packed entries in 'buf'
+// and move '*pos' past it. Returns false once there are no more.
+static bool nextDirent(const char *buf, size_t len, size_t *pos,
+                       packedDirent *d) {
+  const char *p = buf + *pos;
+  if (*pos + DIRENT_HEADER > len || *pos + direntSize(direntNameLen(p)) > len)
+    return false;
+  d->uuid = (const unsigned char *)p;
+  memcpy(&d->cookie, p + KEY_SIZE, sizeof(d->cookie));
+  d->type = (mode_t)(unsigned char)p[DIRENT_HEADER - 2] << 12;
+  d->nameLen = direntNameLen(p);
+  d->name = p + DIRENT_HEADER;
+  *pos += direntSize(d->nameLen);
+  return true;
+}
+
+// Readdir cookies handed out so far and the end of the batch reserved in the
+// store.
+static uint64_t nextCookie;
+static uint64_t cookieLimit;
+static pthread_mutex_t cookieLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Take the next readdir cookie, reserving another batch in the store when
+// this one runs out. The reservation is part of the same group commit as the
+// entries using it, so after a crash no cookie is ever handed out twice.
+static int takeCookie(uint64_t *cookie) {
+  int rc = 0;
+  pthread_mutex_lock(&cookieLock);
+  if (nextCookie == cookieLimit) {
+    uint64_t limit = cookieLimit + COOKIE_BATCH;
+    if (kvStore(COOKIE_KEY, KEY_SIZE, &limit, sizeof(limit)) == UNQLITE_OK)
+      cookieLimit = limit;
+    else
+      rc = -EIO;
   }
+  if (rc == 0)
+    *cookie = nextCookie++;
+  pthread_mutex_unlock(&cookieLock);
+  return rc;
+}
+
+// Carry on from the cookies reserved by earlier mounts.
+static void initCookies() {
+  unqlite_int64 nBytes = sizeof(cookieLimit);
+  int rc = kvFetch(COOKIE_KEY, KEY_SIZE, &cookieLimit, &nBytes);
+  if (rc != UNQLITE_OK && rc != UNQLITE_NOTFOUND)
+    error_handler(rc);
+  nextCookie = cookieLimit;
+}
+
+// Key of segment 'segment' of the entries of a directory, which live under
+// its 'dataId'.
+static void segmentKey(const uuid_t dataId, uint32_t segment,
+                       unsigned char *key) {
+  chunkKey(dataId, segment, key);
+}
+
+// Get the number of the last segment of the directory 'dir', which has some
+// entries.
+static int lastSegment(const myfcb *dir, uint32_t *last) {
+  unqlite_int64 nBytes = sizeof(*last);
+  int rc = kvFetch(dir->file_data_id, KEY_SIZE, last, &nBytes);
+  if (rc != UNQLITE_OK || nBytes != sizeof(*last))
+    return -EIO;
   return 0;
 }
 
-// Read a directory.
-// Read 'man 2 readdir'.
-static int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                        off_t offset, struct fuse_file_info *fi) {
+// Fetch segment 'segment' of the entries of the directory 'dir' into 'buf',
+// which holds DIRENT_SEGMENT_SIZE bytes, and get its length. A segment that
+// was emptied has been deleted, and has no entries.
+static int fetchSegment(const myfcb *dir, uint32_t segment, char *buf,
+                        size_t *len) {
+  unsigned char key[CHUNK_KEY_SIZE];
+  segmentKey(dir->file_data_id, segment, key);
+  unqlite_int64 nBytes = DIRENT_SEGMENT_SIZE;
+  int rc = kvFetch(key, CHUNK_KEY_SIZE, buf, &nBytes);
+  if (rc == UNQLITE_NOTFOUND)
+    nBytes = 0;
+  else if (rc != UNQLITE_OK)
+    return -EIO;
+  *len = nBytes;
+  return 0;
+}
 
-  (void)offset; // This prevents compiler warnings
-  (void)fi;
+// Call 'visit' for each entry of the directory 'dir' until it returns
+// non-zero. The entries are fetched a segment at a time, so that memory use
+// does not grow with the directory.
+static int walkDirents(const myfcb *dir,
+                       int (*visit)(const packedDirent *d, void *arg),
+                       void *arg) {
+  if (dir->size == 0)
+    return 0;
+  uint32_t last;
+  int rc = lastSegment(dir, &last);
+  char segment[DIRENT_SEGMENT_SIZE];
+  for (uint32_t s = 0; rc == 0 && s <= last; s++) {
+    size_t len, pos = 0;
+    packedDirent d;
+    rc = fetchSegment(dir, s, segment, &len);
+    while (rc == 0 && nextDirent(segment, len, &pos, &d)) {
+      if (visit(&d, arg) != 0)
+        return 0;
+    }
+  }
+  return rc;
+}
 
-  write_log("write_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, "
-            "offset=%lld, fi=0x%08x)\n",
-            path, buf, filler, offset, fi);
-  // info on filler()
-  filler(buf, ".", NULL, 0);
-  filler(buf, "..", NULL, 0);
-myfcb directory;
-    write_log("readdir is a directory\n");
-  int result = getFCBFromPath(path, &directory);
-  if (result < 0) {
-    return -ENOENT;
+// Add an entry for 'name' to the directory 'parentFCB' stored under
+// 'parUUID': append it to the last segment of the entries that readdir lists,
+// or start a new segment if it does not fit there, and record it in the name
+// index. 'mode' is the mode of the child, which the parent counts if it is a
+// directory. The updated parent FCB is stored.
+static int addDirent(const uuid_t parUUID, myfcb *parentFCB, const char *name,
+                     const uuid_t childUUID, mode_t mode) {
+  char entry[direntSize(MY_MAX_NAME)];
+  uint64_t cookie;
+  int rc = takeCookie(&cookie);
+  if (rc < 0)
+    return rc;
+  size_t len = packDirent(entry, name, childUUID, cookie, mode);
+
+  // Size of 0 represents that the directory does not contain any values
+  unsigned char key[CHUNK_KEY_SIZE];
+  uint32_t last = 0;
+  bool newSegment = parentFCB->size == 0;
+  if (newSegment) {
+    uuid_generate(parentFCB->file_data_id);
+  } else {
+    rc = lastSegment(parentFCB, &last);
+    if (rc < 0)
+      return rc;
+    // Without a buffer only the length of the last segment is fetched
+    unqlite_int64 used;
+    segmentKey(parentFCB->file_data_id, last, key);
+    rc = kvFetch(key, CHUNK_KEY_SIZE, NULL, &used);
+    if (rc == UNQLITE_NOTFOUND)
+      used = 0;
+    else if (rc != UNQLITE_OK)
+      return -EIO;
+    if (used + len > DIRENT_SEGMENT_SIZE) {
+      newSegment = true;
+      last++;
+    }
   }
-  if (!S_ISDIR(directory.mode))
-    return -1;
-  int count = directory.size / sizeof(dirent);
-  if (count == 0)
-    return 0;
-  unqlite_int64 nBytes = sizeof(dirent) * count;
+  if (newSegment &&
+      kvStore(parentFCB->file_data_id, KEY_SIZE, &last, sizeof(last)) !=
+          UNQLITE_OK)
+    return -EIO;
+  segmentKey(parentFCB->file_data_id, last, key);
+  if (kvAppend(key, CHUNK_KEY_SIZE, entry, len) != UNQLITE_OK)
+    return -EIO;
+  rc = indexInsert(parUUID, name, childUUID, last);
+  if (rc < 0)
+    return rc;
+
+  parentFCB->size += len;
+  if (S_ISDIR(mode))
+    parentFCB->subdirs++;
+  parentFCB->mtime = time(NULL);
+  return storeFCB(parUUID, parentFCB);
+}
 
-    dirent dirents[count];
-  result = unqlite_kv_fetch(pDb, directory.file_data_id, KEY_SIZE, &dirents,
-                            &nBytes);
-  if (result != UNQLITE_OK)
+// Remove the entry for 'name' from the directory 'parentFCB' stored under
+// 'parUUID'. Only the segment the name index says holds it is fetched and
+// stored back, with the entries after it moved up to close the gap, so this
+// costs the same however big the directory is. The updated parent FCB is
+// stored.
+static int removeDirent(const uuid_t parUUID, myfcb *parentFCB,
+                        const char *name) {
+  if (parentFCB->size == 0)
     return -ENOENT;
+  uint32_t s;
+  int rc = indexRemove(parUUID, name, &s);
+  if (rc < 0)
+    return rc;
+  char segment[DIRENT_SEGMENT_SIZE];
+  size_t used;
+  rc = fetchSegment(parentFCB, s, segment, &used);
+  if (rc < 0)
+    return rc;
+
+  size_t nameLen = strlen(name);
+  size_t pos = 0, start = 0;
+  packedDirent d;
+  bool found = false;
+  while (!found && nextDirent(segment, used, &pos, &d)) {
+    found = d.nameLen == nameLen && memcmp(d.name, name, nameLen) == 0;
+    if (!found)
+      start = pos;
+  }
+  // The index and the entries disagree
+  if (!found)
+    return -EIO;
+
+  size_t len = pos - start;
+  mode_t type = d.type;
+  unsigned char key[CHUNK_KEY_SIZE];
+  segmentKey(parentFCB->file_data_id, s, key);
+  if (len == used) {
+    rc = kvDelete(key, CHUNK_KEY_SIZE);
+  } else {
+    memmove(segment + start, segment + pos, used - pos);
+    rc = kvStore(key, CHUNK_KEY_SIZE, segment, used - len);
+  }
+  if (rc == UNQLITE_OK && len == parentFCB->size) {
+    // That was the last entry: the segment number goes too
+    rc = kvDelete(parentFCB->file_data_id, KEY_SIZE);
+    uuid_copy(parentFCB->file_data_id, zero_uuid);
+  }
+  if (rc != UNQLITE_OK)
+    return -EIO;
+  inodeChanged(parUUID);
+  dcacheRemove(parUUID, name);
+
+  parentFCB->size -= len;
+  if (S_ISDIR(type) && parentFCB->subdirs > 0)
+    parentFCB->subdirs--;
+  parentFCB->mtime = time(NULL);
+  return storeFCB(parUUID, parentFCB);
+}
 
-//TODO Change to stat struct rather than fuse struct
-  nBytes = sizeof(myfcb);
-  for (int i = 0; i < count; i++) {
-    filler(buf, dirents[i].name, NULL, 0);
+// Number of chunks needed to hold 'size' bytes.
+static uint64_t chunkCount(off_t size) {
+  return (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+}
+
+// Read chunk 'index' into 'buf', which must hold CHUNK_SIZE bytes, and return
+// the number of bytes actually stored. Chunks are only stored up to the last
+// byte written, so a short or missing chunk (a hole) reads back as zeros.
+static int readChunk(const uuid_t dataId, uint64_t index, char *buf) {
+  unsigned char key[CHUNK_KEY_SIZE];
+  chunkKey(dataId, index, key);
+  unqlite_int64 nBytes = CHUNK_SIZE;
+  int rc = kvFetch(key, CHUNK_KEY_SIZE, buf, &nBytes);
+  if (rc == UNQLITE_NOTFOUND) {
+    nBytes = 0;
+  } else if (rc != UNQLITE_OK) {
+    return -EIO;
   }
+  memset(buf + nBytes, 0, CHUNK_SIZE - nBytes);
+  return nBytes;
+}
 
+static int storeChunk(const uuid_t dataId, uint64_t index, const char *buf,
+                      size_t len) {
+  unsigned char key[CHUNK_KEY_SIZE];
+  chunkKey(dataId, index, key);
+  if (kvStore(key, CHUNK_KEY_SIZE, buf, len) != UNQLITE_OK)
+    return -EIO;
   return 0;
 }
 
-// Delete a directory.
-// Read 'man 2 rmdir'.
-int myfs_rmdir(const char *path) {
-  write_log("myfs_rmdir: %s\n", path);
-  char copy [strlen(path) +1];
-  strcpy(copy,path);
-  char* rmDir = basename(copy);
-  uuid_t parUUID;
-  int result = getParentUUID(&parUUID,path);
-  myfcb parFCB;
-  unqlite_int64 nBytes= sizeof(myfcb);
-  result = unqlite_kv_fetch(pDb,parUUID,KEY_SIZE,&parFCB,&nBytes);
-  if (result != UNQLITE_OK || nBytes != sizeof(myfcb)){
-    write_log("The unqlite fetch of the parent fcb failed\n");
-    return result;
+// Drop chunk 'index', turning it into a hole.
+static int deleteChunk(const uuid_t dataId, uint64_t index) {
+  unsigned char key[CHUNK_KEY_SIZE];
+  chunkKey(dataId, index, key);
+  int rc = kvDelete(key, CHUNK_KEY_SIZE);
+  if (rc != UNQLITE_OK && rc != UNQLITE_NOTFOUND)
+    return -EIO;
+  return 0;
+}
+
+static bool isZero(const char *buf, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (buf[i] != 0)
+      return false;
   }
-  bool isRoot = false;
-  if (uuid_compare(ROOT_OBJECT_KEY,parUUID) ==0){
-    isRoot = true;
+  return true;
+}
+
+// State for copying one byte range of a chunk straight out of the store.
+struct rangeCopy {
+  char *dest;
+  size_t skip; // bytes of the chunk still to pass over before the range
+  size_t want; // bytes of the range still to copy
+};
+
+// unqlite_kv_fetch_callback consumer: the chunk is delivered page by page, so
+// copy only the requested slice and stop the fetch once it is complete.
+static int copyRange(const void *data, unsigned int len, void *arg) {
+  struct rangeCopy *range = arg;
+  const char *p = data;
+  if (range->skip >= len) {
+    range->skip -= len;
+    return UNQLITE_OK;
   }
+  p += range->skip;
+  len -= range->skip;
+  range->skip = 0;
+  size_t n = len < range->want ? len : range->want;
+  memcpy(range->dest, p, n);
+  range->dest += n;
+  range->want -= n;
+  return range->want == 0 ? UNQLITE_ABORT : UNQLITE_OK;
+}
 
-  int count = parFCB.size/sizeof(dirent);
+// Read 'len' bytes starting 'within' bytes into chunk 'index' directly into
+// 'dest'. Whatever the stored chunk does not cover reads back as zeros.
+static int readChunkRange(const uuid_t dataId, uint64_t index, size_t within,
+                          char *dest, size_t len) {
+  unsigned char key[CHUNK_KEY_SIZE];
+  chunkKey(dataId, index, key);
+  struct rangeCopy range = {dest, within, len};
+  int rc = kvFetchCallback(key, CHUNK_KEY_SIZE, copyRange, &range);
+  // UNQLITE_ABORT is our own early stop once the range has been copied
+  if (rc != UNQLITE_OK && rc != UNQLITE_NOTFOUND &&
+      !(rc == UNQLITE_ABORT && range.want == 0))
+    return -EIO;
+  memset(range.dest, 0, range.want);
+  return 0;
+}
 
-  if (count ==0){
+// Read 'len' bytes at 'offset' of the inline data of a small file straight
+// out of its FCB record into 'dest'. A record too short for the range means
+// it no longer matches the FCB the caller read the size from.
+static int readInlineRange(const uuid_t uuid, off_t offset, char *dest,
+                           size_t len) {
+  struct rangeCopy range = {dest, sizeof(myfcb) + offset, len};
+  int rc = kvFetchCallback(uuid, KEY_SIZE, copyRange, &range);
+  if (rc == UNQLITE_NOTFOUND)
     return -ENOENT;
-  } else {
-    nBytes = sizeof(dirent) * count;
-
-    dirent dirents[count];
-    result = unqlite_kv_fetch(pDb, parFCB.file_data_id, KEY_SIZE, &dirents,
-                             &nBytes);
-    if (result != UNQLITE_OK || nBytes != (sizeof(dirent) * count))return -ENOENT;
-    if (count ==1){
-      myfcb delFCB;
-      nBytes = sizeof(myfcb);
-      result = unqlite_kv_fetch(pDb,dirents[0].referencedFCB,KEY_SIZE,&delFCB,&nBytes);
-      if (result != UNQLITE_OK || nBytes != sizeof(myfcb))return -ENOENT;
-      if (delFCB.size != 0) return -ENOTEMPTY;
-      result = unqlite_kv_delete(pDb,parFCB.file_data_id,KEY_SIZE);
-      if (result != UNQLITE_OK){
-        return -1;
-      }
-      uuid_copy(parFCB.file_data_id,zero_uuid);
-      if (isRoot == true){
-        uuid_copy(the_root_fcb.file_data_id,zero_uuid);
-      }
-    } else {
-      int index  =0;
-      for (int i =0;i < count;i++){
-        if (strcmp(rmDir,dirents[i].name) ==0) {
-          index = i;
-          myfcb delFCB;
-          nBytes = sizeof(myfcb);
-          result = unqlite_kv_fetch(pDb,dirents[i].referencedFCB,KEY_SIZE,&delFCB,&nBytes);
-          if (result != UNQLITE_OK || nBytes != sizeof(myfcb))return -ENOENT;
-          if (delFCB.size != 0) return -ENOTEMPTY;
-
-          break;
-        }
-      }
+  if (range.want != 0 || (rc != UNQLITE_OK && rc != UNQLITE_ABORT))
+    return -EIO;
+  return 0;
+}
+
+// Read 'size' bytes at 'offset' of the file described by 'fcb', stored under
+// 'uuid', into 'buf'. The caller has already clipped the range to the file
+// size. Only the requested bytes of the FCB record (for a small file) or of
+// the overlapping chunks are copied, straight into 'buf'.
+static int readFileData(const uuid_t uuid, const myfcb *fcb, char *buf,
+                        size_t size, off_t offset) {
+  if (isInline(fcb))
+    return readInlineRange(uuid, offset, buf, size);
+  size_t done = 0;
+  while (done < size) {
+    uint64_t index = (offset + done) / CHUNK_SIZE;
+    size_t within = (offset + done) % CHUNK_SIZE;
+    size_t len = CHUNK_SIZE - within;
+    if (len > size - done)
+      len = size - done;
+    if (readChunkRange(fcb->file_data_id, index, within, buf + done, len) < 0)
+      return -EIO;
+    done += len;
+  }
+  return 0;
+}
+
+// Move the data of a small file out of its FCB record into chunk 0, as the
+// file is about to grow past INLINE_DATA_MAX. The caller stores the FCB.
+static int spillInline(const uuid_t uuid, const myfcb *fcb) {
+  if (fcb->size == 0)
+    return 0;
+  myfcb stored;
+  char data[INLINE_DATA_MAX];
+  int rc = fetchRecord(uuid, &stored, data);
+  if (rc == 0)
+    rc = storeChunk(fcb->file_data_id, 0, data, stored.size);
+  return rc;
+}
 
-      result = unqlite_kv_delete(pDb,dirents[index].referencedFCB,KEY_SIZE);
-      if (result != UNQLITE_OK){
-        return -1;
+// Write 'size' bytes at 'offset' into a small file that stays small, then
+// store its FCB record.
+static int writeInline(const uuid_t uuid, myfcb *fcb, const char *buf,
+                       size_t size, off_t offset) {
+  char data[INLINE_DATA_MAX];
+  off_t newSize = offset + size > fcb->size ? offset + size : fcb->size;
+  // The old contents are only needed if the write leaves some of them
+  if (fcb->size > 0 && (offset > 0 || size < fcb->size)) {
+    myfcb stored;
+    int rc = fetchRecord(uuid, &stored, data);
+    if (rc < 0)
+      return rc;
+  }
+  if (offset > fcb->size)
+    memset(data + fcb->size, 0, offset - fcb->size);
+  memcpy(data + offset, buf, size);
+  fcb->size = newSize;
+  return storeRecord(uuid, fcb, data);
+}
+
+// Write 'size' bytes at 'offset' into the file described by 'fcb', stored
+// under 'uuid', and store the FCB with its new size. A file that stays small
+// is rewritten in its FCB record. Otherwise only the chunks overlapping the
+// range are touched: fully covered chunks are stored straight from 'buf',
+// partially covered ones are fetched, patched and stored back. Writing past
+// the end of the file leaves a hole that costs nothing: the chunks in between
+// are never stored, a chunk is only stored up to its last byte written, and
+// a chunk that is all zeros is dropped rather than stored.
+static int writeFileData(const uuid_t uuid, myfcb *fcb, const char *buf,
+                         size_t size, off_t offset) {
+  off_t newSize = offset + size > fcb->size ? offset + size : fcb->size;
+  if (!S_ISDIR(fcb->mode) && newSize <= INLINE_DATA_MAX)
+    return writeInline(uuid, fcb, buf, size, offset);
+  if (isInline(fcb)) {
+    int rc = spillInline(uuid, fcb);
+    if (rc < 0)
+      return rc;
+  }
+  char *chunk = NULL;
+  size_t done = 0;
+  while (done < size) {
+    uint64_t index = (offset + done) / CHUNK_SIZE;
+    off_t chunkStart = (off_t)index * CHUNK_SIZE;
+    size_t within = (offset + done) % CHUNK_SIZE;
+    size_t len = CHUNK_SIZE - within;
+    if (len > size - done)
+      len = size - done;
+    // Chunks are stored up to the end of the file at most
+    size_t chunkLen = newSize - chunkStart < CHUNK_SIZE ? newSize - chunkStart
+                                                        : CHUNK_SIZE;
+    int rc;
+    if (within == 0 && len == chunkLen) {
+      if (!isZero(buf + done, len))
+        rc = storeChunk(fcb->file_data_id, index, buf + done, len);
+      else if (chunkStart < fcb->size)
+        rc = deleteChunk(fcb->file_data_id, index);
+      else
+        rc = 0;
+    } else {
+      if (chunk == NULL && (chunk = malloc(CHUNK_SIZE)) == NULL)
+        return -ENOMEM;
+      if (chunkStart < fcb->size) {
+        rc = readChunk(fcb->file_data_id, index, chunk);
+      } else {
+        memset(chunk, 0, CHUNK_SIZE);
+        rc = 0;
       }
-      if (index != (count-1)){
-        strcpy(dirents[index].name,dirents[count-1].name);
-        uuid_copy(dirents[index].referencedFCB,dirents[count-1].referencedFCB);
+      if (rc >= 0) {
+        size_t stored = (size_t)rc > within + len ? rc : within + len;
+        memcpy(chunk + within, buf + done, len);
+        rc = storeChunk(fcb->file_data_id, index, chunk, stored);
       }
-      result = unqlite_kv_store(pDb,parFCB.file_data_id,KEY_SIZE,&dirents,sizeof(dirent) *(count -1));
-      if (result != UNQLITE_OK) return -1;
     }
-    if (isRoot == true){
-      the_root_fcb.size -= sizeof(dirent);
+    if (rc < 0) {
+      free(chunk);
+      return rc;
     }
-    parFCB.size -= sizeof(dirent);
-    nBytes = sizeof(myfcb);
-    result = unqlite_kv_store(pDb,parUUID,KEY_SIZE,&parFCB,sizeof(myfcb));
-    if (result != UNQLITE_OK || nBytes != sizeof(myfcb)) return -1;
+    done += len;
   }
-  //TODO
-  //Remove the Record from the parent
-  //Delete the record
+  free(chunk);
+  fcb->size = newSize;
+  return storeRecord(uuid, fcb, NULL);
+}
 
+// Delete every chunk of the file described by 'fcb'.
+static int deleteFileData(const myfcb *fcb) {
+  if (isInline(fcb))
+    return 0;
+  for (uint64_t i = 0; i < chunkCount(fcb->size); i++) {
+    int rc = deleteChunk(fcb->file_data_id, i);
+    if (rc < 0)
+      return rc;
+  }
   return 0;
 }
 
+// Change the size of the file described by 'fcb', stored under 'uuid', and
+// store the FCB. A file that ends up small keeps its data in the FCB record.
+// Otherwise shrinking deletes the chunks past the new end and trims the new
+// last chunk, so that growing the file again reads back zeros. Growing only
+// changes the size: the new range is a hole.
+static int truncateFileData(const uuid_t uuid, myfcb *fcb, off_t newsize) {
+  if (newsize <= INLINE_DATA_MAX) {
+    char data[INLINE_DATA_MAX];
+    int rc = 0;
+    if (isInline(fcb)) {
+      myfcb stored;
+      if (fcb->size > 0)
+        rc = fetchRecord(uuid, &stored, data);
+    } else {
+      // Shrinking into the FCB record: keep the head, drop every chunk
+      rc = readFileData(uuid, fcb, data, newsize, 0);
+      if (rc == 0)
+        rc = deleteFileData(fcb);
+    }
+    if (rc < 0)
+      return rc;
+    if (newsize > fcb->size)
+      memset(data + fcb->size, 0, newsize - fcb->size);
+    fcb->size = newsize;
+    return storeRecord(uuid, fcb, data);
+  }
+  if (isInline(fcb)) {
+    int rc = spillInline(uuid, fcb);
+    if (rc < 0)
+      return rc;
+  } else if (newsize < fcb->size) {
+    uint64_t keep = chunkCount(newsize);
+    for (uint64_t i = keep; i < chunkCount(fcb->size); i++) {
+      int rc = deleteChunk(fcb->file_data_id, i);
+      if (rc < 0)
+        return rc;
+    }
+    size_t tail = newsize % CHUNK_SIZE;
+    if (tail != 0) {
+      char *chunk = malloc(CHUNK_SIZE);
+      if (chunk == NULL)
+        return -ENOMEM;
+      int rc = readChunk(fcb->file_data_id, keep - 1, chunk);
+      // Only a chunk that holds data past the new end needs trimming
+      if (rc > (int)tail)
+        rc = storeChunk(fcb->file_data_id, keep - 1, chunk, tail);
+      free(chunk);
+      if (rc < 0)
+        return rc;
+    }
+  }
+  fcb->size = newsize;
+  return storeRecord(uuid, fcb, NULL);
+}
 
-// Read a file.
-// Read 'man 2 read'.
-static int myfs_read(const char *path, char *buf, size_t size, off_t offset,
-                     struct fuse_file_info *fi) {
-  size_t len;
-  (void)fi;
+// Write the write-back buffer of the open file 'of', whose FCB is 'fcb', to
+// the store and drop it. The caller holds the inode lock exclusively, inside
+// a transaction. The buffer is dropped even if the write fails: the error is
+// reported once, to whoever flushes.
+static int flushDirty(openfile *of, myfcb *fcb) {
+  if (of->dirtyLen == 0)
+    return 0;
+  int rc = writeFileData(of->uuid, fcb, of->dirty, of->dirtyLen,
+                         of->dirtyOff);
+  dropDirty(of);
+  return rc;
+}
 
-  write_log(
-      "myfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
-      path, buf, size, offset, fi);
-      char copy[strlen(path) + 1];
-      strcpy(copy, path);
-      int rc;
-      uuid_t parUUID;
-      unqlite_int64 nBytes = sizeof(myfcb);
-      char *name = basename(copy);
-      strcpy(copy, path);
-      rc = getParentUUID(&parUUID, path);
-      write_log("read GETS THE PARENT UUID the parent uuid is %s\n",parUUID);
-      if (rc < 0) {
-        return -ENOENT;
-      }
-      myfcb parentFCB;
-      nBytes = sizeof(myfcb);
-      write_log("uuid is %s length of the key is %d nBytes is %d\n",parUUID,KEY_SIZE,nBytes );
-      rc = unqlite_kv_fetch(pDb, parUUID, KEY_SIZE, &parentFCB, &nBytes);
-      if (rc != UNQLITE_OK) {
-        write_log("Fetch Seems to be failing\n");
-        return -1;
-      }
-      int count = parentFCB.size / sizeof(dirent);
-      if (count <1) return -1;
-      dirent dirents[count];
-      nBytes = sizeof(dirent) *count;
-      rc = unqlite_kv_fetch(pDb, parentFCB.file_data_id, KEY_SIZE, &dirents,
-                               &nBytes);
-      if (rc != UNQLITE_OK || nBytes != (sizeof(dirent) * count))return -ENOENT;
-
-      uuid_t writeUUID;
-      for (int i = 0; i < count;i++){
-        if (strcmp(name,dirents[i].name) ==0){
-          uuid_copy(writeUUID,dirents[i].referencedFCB);
-          break;
-        }
-      }
-      myfcb referencedFCB;
-      nBytes = sizeof(myfcb);
-      rc = unqlite_kv_fetch(pDb, writeUUID,KEY_SIZE,&referencedFCB,&nBytes);
-      if (rc != UNQLITE_OK || nBytes != sizeof(myfcb)) return -1;
-      write_log("seems to be able to get past the setup\n");
-      char * buffer = malloc(referencedFCB.size +1);
-      write_log("after the mallocing\n");
-      nBytes = referencedFCB.size;
-      write_log("the requested read size %d,offset is %d,size is %d\n",offset +size,offset,size);
-      int actualsize =size;
-      if (size +offset > referencedFCB.size){
-        actualsize = referencedFCB.size - offset;
-      }
-      rc = unqlite_kv_fetch(pDb, referencedFCB.file_data_id,KEY_SIZE,buffer,&nBytes);
-      if (rc != UNQLITE_OK || nBytes != referencedFCB.size){
-        write_log("fetch of the buffer is failing\n");
-        free(buffer);
-        return -1;
-      }
-      write_log("fetches the buffer, offset is %d, actualsize is %d\n",offset,actualsize);
-      write_log("the start is %p, %p\n\n",buffer, buffer+offset);
-      memcpy(buf,buffer+offset,actualsize);
-      write_log("copies into the buffer\n");
+// The functions which follow are handler functions for various things a
+// filesystem needs to do:
+// reading, getting attributes, truncating, etc. They will be called by FUSE
+// whenever it needs
+// your filesystem to do something, so this is where functionality goes.
+//
+// FUSE names files and directories by their inode number (see the inode
+// table above) and each handler replies to its request itself. Handlers that
+// change the store run between txnEnter and txnExit, and reply once they
+// have left the batch.
+
+// How long the kernel may cache attributes, names and missing names, in
+// seconds, and whether open files keep their pages in its page cache. See
+// ATTR_TIMEOUT.
+static double attrTimeout = ATTR_TIMEOUT;
+static double entryTimeout = ENTRY_TIMEOUT;
+static double negativeTimeout = NEGATIVE_TIMEOUT;
+static bool kernelCache = true;
+
+// Fill in the attributes of 'fcb', stored under 'uuid', for stat.
+static void fillStat(const uuid_t uuid, const myfcb *fcb, struct stat *stbuf) {
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_ino = uuidIno(uuid);
+  stbuf->st_mode = fcb->mode;
+  // A directory is linked from its parent, from its own "." and from the
+  // ".." of each subdirectory
+  stbuf->st_nlink = S_ISDIR(fcb->mode) ? 2 + fcb->subdirs : 1;
+  stbuf->st_mtime = fcb->mtime;
+  stbuf->st_ctime = fcb->ctime;
+  stbuf->st_size = fcb->size;
+  if (S_ISREG(fcb->mode)) {
+    off_t end = openfileDirtyEnd(uuid);
+    if (end > stbuf->st_size)
+      stbuf->st_size = end;
+  }
+  stbuf->st_uid = fcb->uid;
+  stbuf->st_gid = fcb->gid;
+}
 
-      free(buffer);
-      return actualsize;
-             // if (offset > referencedFCB.size)
+// Describe the inode of 'uuid', whose FCB as of its generation 'gen' is
+// 'fcb', to the kernel, taking a lookup reference on it.
+static int makeEntry(const uuid_t uuid, const myfcb *fcb, unsigned long gen,
+                     struct fuse_entry_param *e) {
+  memset(e, 0, sizeof(*e));
+  myfcb current = *fcb;
+  int rc;
+  while ((rc = itableGet(uuid, &current, gen, &e->ino)) == -EAGAIN) {
+    gen = inodeGeneration(uuid);
+    rc = fetchFCB(uuid, &current);
+    if (rc < 0)
+      return rc;
+  }
+  if (rc < 0)
+    return rc;
+  fillStat(uuid, &current, &e->attr);
+  e->attr_timeout = attrTimeout;
+  e->entry_timeout = entryTimeout;
+  return 0;
+}
 
-  // return size;
+// Reply with the entry for 'uuid', or with the error 'rc'.
+static void replyEntry(fuse_req_t req, int rc, const uuid_t uuid,
+                       const myfcb *fcb, unsigned long gen) {
+  struct fuse_entry_param e;
+  if (rc == 0)
+    rc = makeEntry(uuid, fcb, gen, &e);
+  if (rc < 0)
+    fuse_reply_err(req, -rc);
+  else if (fuse_reply_entry(req, &e) != 0)
+    itableForget(e.ino, 1);
 }
 
-// This file system only supports one file. Create should fail if a file has
-// been created. Path must be '/<something>'.
-// Read 'man 2 creat'.
-static int myfs_create(const char *path, mode_t mode,
-                       struct fuse_file_info *fi) {
-  write_log("myfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n", path, mode,
-            fi);
-            write_log("myfs_create: %s\n", path);
-            bool isRoot = false;
-            char copy[strlen(path) + 1];
-            strcpy(copy, path);
-            int rc;
-            uuid_t parUUID;
-            unqlite_int64 nBytes = sizeof(myfcb);
-            char *name = basename(copy);
-            strcpy(copy, path);
-            rc = getParentUUID(&parUUID, path);
-            write_log("mkdir GETS THE PARENT UUID the parent uuid is %s\n",parUUID);
-            // if (rc ==5)
-            if (rc < 0) {
-              return -ENOENT;
-            }
-            bool updateCacheRoot = false;
-            if (uuid_compare(parUUID,ROOT_OBJECT_KEY) ==0){
-              updateCacheRoot =true;
-            }
-            myfcb parentFCB;
-            nBytes = sizeof(myfcb);
-            write_log("uuid is %s length of the key is %d nBytes is %d\n",parUUID,KEY_SIZE,nBytes );
-            rc = unqlite_kv_fetch(pDb, parUUID, KEY_SIZE, &parentFCB, &nBytes);
-            if (rc != UNQLITE_OK) {
-              write_log("Fetch Seems to be failing\n");
-              return -1;
-            }
-            write_log("mkdir Fetches the Parent UUID \n");
-
-            // Size of 0 represents that the directory does not contain any values
-            myfcb newFCB;
-            uuid_t temp;
-            uuid_generate(temp);
-            uuid_copy(newFCB.file_data_id, temp);
-            newFCB.size = 0;
-            newFCB.ctime = time(NULL);
-            newFCB.mtime = time(NULL);
-            newFCB.mode = mode;
-            newFCB.uid = getuid();
-            newFCB.gid = getgid();
-            uuid_t uid;
-            uuid_generate(uid);
-            rc = unqlite_kv_store(pDb, uid, KEY_SIZE, &newFCB, sizeof(myfcb));
-            if (rc != UNQLITE_OK) {
-              return -1;
-            }
-            write_log("mkdir stores the new FCB\n");
-
-            dirent newDirent;
-            strcpy(newDirent.name, name);
-            uuid_copy(newDirent.referencedFCB, uid);
-
-            uuid_t direntUUID;
-            if (parentFCB.size == 0) {
-              uuid_generate(direntUUID);
-              uuid_copy(parentFCB.file_data_id, direntUUID);
-              if (updateCacheRoot == true){
-                uuid_copy(the_root_fcb.file_data_id,direntUUID);
-              }
-            } else {
-              uuid_copy(direntUUID, parentFCB.file_data_id);
-            }
-
-            rc = unqlite_kv_append(pDb, direntUUID, KEY_SIZE, &newDirent, sizeof(dirent));
-            if (rc != UNQLITE_OK) {
-              return -ENOENT;
-            }
-
-            parentFCB.size += sizeof(dirent);
-            if (isRoot) {
-              the_root_fcb.size += sizeof(dirent);
-            }
-            if (updateCacheRoot == true){
-              the_root_fcb.size += sizeof(dirent);
-            }
-            int retVal =
-                unqlite_kv_store(pDb, parUUID, KEY_SIZE, &parentFCB, sizeof(myfcb));
-            if (rc != UNQLITE_OK) {
-              return -ENOENT;
-            }
+// The statistics entry 'name' of the directory 'parent', or 0 if there is
+// none.
+static fuse_ino_t statsEntry(fuse_ino_t parent, const char *name) {
+  if (parent == FUSE_ROOT_ID && strcmp(name, STATS_DIR_NAME) == 0)
+    return STATS_DIR_INO;
+  if (parent == STATS_DIR_INO && strcmp(name, STATS_FILE_NAME) == 0)
+    return STATS_FILE_INO;
+  return 0;
+}
+
+// Fill in the attributes of a statistics inode. The file is read-only and
+// has no size: it is opened with direct I/O, so reads are not cut off at
+// the size the kernel knows.
+static void statsStat(fuse_ino_t ino, struct stat *stbuf) {
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_ino = ino;
+  if (ino == STATS_DIR_INO) {
+    stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_nlink = 2;
+  } else {
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+  }
+  stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+  stbuf->st_uid = getuid();
+  stbuf->st_gid = getgid();
+}
+
+// The latency, in microseconds, within which a fraction 'q' of the 'calls'
+// counted in 'buckets' completed: the end of the bucket holding the call of
+// that rank, or 'maxNs' if that is sooner.
+static double statsPercentile(const unsigned long long *buckets,
+                              unsigned long long calls, double q,
+                              unsigned long long maxNs) {
+  unsigned long long rank = q * calls + 0.999999;
+  unsigned long long seen = 0;
+  unsigned b = 0;
+  while (b < STATS_BUCKETS - 1 && (seen += buckets[b]) < rank)
+    b++;
+  uint64_t end = b < STATS_BUCKETS - 1 ? statsBucketStart(b + 1) : maxNs;
+  return (end < maxNs ? end : maxNs) / 1000.0;
+}
+
+// Print the statistics of every operation that has run: a summary line each,
+// then their latency histograms.
+static void statsReport(FILE *out) {
+  static unsigned long long buckets[OP_COUNT][STATS_BUCKETS];
+  static pthread_mutex_t reportLock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_lock(&reportLock);
+  fprintf(out, "%-8s %10s %9s %9s %9s %9s %9s %10s %12s %10s %12s %9s\n",
+          "op", "calls", "avg_us", "p50_us", "p90_us", "p99_us", "max_us",
+          "fetches", "fetch_bytes", "stores", "store_bytes", "deletes");
+  unsigned long long calls[OP_COUNT];
+  unsigned long long maxNs[OP_COUNT];
+  for (int op = 0; op < OP_COUNT; op++) {
+    struct opStats *s = &opStats[op];
+    // The histogram is read once, so the percentiles agree with each other
+    calls[op] = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+      buckets[op][b] = atomic_load_explicit(&s->buckets[b],
+                                            memory_order_relaxed);
+      calls[op] += buckets[op][b];
+    }
+    maxNs[op] = atomic_load_explicit(&s->maxNs, memory_order_relaxed);
+    if (calls[op] == 0)
+      continue;
+    fprintf(out,
+            "%-8s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f %10llu %12llu %10llu "
+            "%12llu %9llu\n",
+            statsOpNames[op], calls[op],
+            atomic_load_explicit(&s->totalNs, memory_order_relaxed) / 1000.0 /
+                calls[op],
+            statsPercentile(buckets[op], calls[op], 0.5, maxNs[op]),
+            statsPercentile(buckets[op], calls[op], 0.9, maxNs[op]),
+            statsPercentile(buckets[op], calls[op], 0.99, maxNs[op]),
+            maxNs[op] / 1000.0,
+            (unsigned long long)atomic_load(&s->fetches),
+            (unsigned long long)atomic_load(&s->fetchBytes),
+            (unsigned long long)atomic_load(&s->stores),
+            (unsigned long long)atomic_load(&s->storeBytes),
+            (unsigned long long)atomic_load(&s->deletes));
+  }
+  fprintf(out, "\nwrite-back: %zu bytes buffered\n",
+          atomic_load(&writebackBytes));
+  dcacheReport(out);
+  for (int op = 0; op < OP_COUNT; op++) {
+    if (calls[op] == 0)
+      continue;
+    fprintf(out, "\n%s latency (us): calls\n", statsOpNames[op]);
+    for (unsigned b = 0; b < STATS_BUCKETS; b++) {
+      if (buckets[op][b] == 0)
+        continue;
+      uint64_t end =
+          b < STATS_BUCKETS - 1 ? statsBucketStart(b + 1) : maxNs[op];
+      fprintf(out, "  %12.3f - %12.3f: %llu\n", statsBucketStart(b) / 1000.0,
+              end / 1000.0, buckets[op][b]);
+    }
+  }
+  pthread_mutex_unlock(&reportLock);
+}
+
+// Reply to a lookup of the statistics inode 'ino'. Its lookups are not
+// counted: it is never forgotten.
+static void replyStatsEntry(fuse_req_t req, fuse_ino_t ino) {
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  e.ino = ino;
+  statsStat(ino, &e.attr);
+  e.attr_timeout = attrTimeout;
+  e.entry_timeout = entryTimeout;
+  fuse_reply_entry(req, &e);
+}
+
+// Open the statistics file: the statistics as they are now are printed into
+// a buffer, which reads of this file descriptor are served from and release
+// frees. fi->fh holds the buffer rather than an openfile.
+static void statsOpen(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi) {
+  if (ino == STATS_DIR_INO) {
+    fuse_reply_err(req, EISDIR);
+    return;
+  }
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+  char *buf;
+  size_t len;
+  FILE *out = open_memstream(&buf, &len);
+  if (out == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  statsReport(out);
+  if (fclose(out) != 0) {
+    free(buf);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  fi->fh = (uintptr_t)buf;
+  fi->direct_io = 1;
+  if (fuse_reply_open(req, fi) != 0)
+    free(buf);
+}
 
-  return 0;
+// Read the statistics printed when the file was opened.
+static void statsRead(fuse_req_t req, size_t size, off_t offset,
+                      struct fuse_file_info *fi) {
+  const char *buf = (const char *)(uintptr_t)fi->fh;
+  size_t len = strlen(buf);
+  if (offset >= len)
+    size = 0;
+  else if (size > len - offset)
+    size = len - offset;
+  fuse_reply_buf(req, buf + (size > 0 ? offset : 0), size);
 }
 
-// Set update the times (actime, modtime) for a file. This FS only supports
-// modtime.
-// Read 'man 2 utime'.
-static int myfs_utime(const char *path, struct utimbuf *ubuf) {
-  write_log("myfs_utime(path=\"%s\", ubuf=0x%08x)\n", path, ubuf);
-  // // TODO
-  // // if(strcmp(path, the_root_fcb.path) != 0){
-  // // 	write_log("myfs_utime - ENOENT");
-  // // 	return -ENOENT;
-  // // }
-  //
-  //
-  // // Write the fcb to the store.
-  // int rc = unqlite_kv_store(pDb, ROOT_OBJECT_KEY, KEY_SIZE,
-  //                           &the_root_fcb, sizeof(myfcb));
-  // if (rc != UNQLITE_OK) {
-  //   write_log("myfs_write - EIO");
-  //   return -EIO;
-  // }
-  //
-  // return 0;
-  // write_log("mode is %s\n",mode);
-  char name[strlen(path)+1];
-  strcpy(name,path);
-  char*  base = basename(name);
+// Look up a directory entry by name and get its attributes.
+static void myfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  STATS_OP(OP_LOOKUP);
+  log_info("myfs_lookup(parent=%lu, name=\"%s\")\n", (unsigned long)parent,
+           name);
+  fuse_ino_t statsIno = statsEntry(parent, name);
+  if (statsIno != 0) {
+    replyStatsEntry(req, statsIno);
+    return;
+  }
   uuid_t parUUID;
-  int res = getParentUUID(&parUUID,path);
-  if (res < 0) return -1;
   myfcb parFCB;
-  unqlite_int64 nBytes = sizeof(myfcb);
-  res = unqlite_kv_fetch(pDb,parUUID,KEY_SIZE,&parFCB,&nBytes);
-
-  if (res != UNQLITE_OK || nBytes != sizeof(myfcb)){
-    return -1;
+  uuid_t uuid;
+  myfcb fcb;
+  int rc = parent == STATS_DIR_INO ? -ENOENT
+                                   : itableLookup(parent, parUUID, &parFCB);
+  if (rc == 0 && !S_ISDIR(parFCB.mode))
+    rc = -ENOTDIR;
+  if (rc == 0 && strlen(name) > MY_MAX_NAME)
+    rc = -ENAMETOOLONG;
+  unsigned long gen;
+  if (rc == 0)
+    rc = lookupChild(parUUID, name, uuid, &fcb, &gen);
+  if (rc == -ENOENT && negativeTimeout > 0) {
+    // An entry with inode number 0 lets the kernel cache the miss
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = negativeTimeout;
+    fuse_reply_entry(req, &e);
+    return;
   }
+  replyEntry(req, rc, uuid, &fcb, gen);
+}
 
-  int count = parFCB.size/sizeof(dirent);
-
-  if (count < 1) return -1;
-
-  dirent dirs[count];
-  nBytes = sizeof(dirent) *count;
-  res = unqlite_kv_fetch(pDb,parFCB.file_data_id,KEY_SIZE,&dirs,&nBytes);
+// The kernel has dropped 'nlookup' references to the inode 'ino'.
+static void myfs_forget(fuse_req_t req, fuse_ino_t ino,
+                        unsigned long nlookup) {
+  STATS_OP(OP_FORGET);
+  itableForget(ino, nlookup);
+  fuse_reply_none(req);
+}
 
-  if (res != UNQLITE_OK || nBytes != sizeof(dirent) *count){
-    return -1;
+// Get file and directory attributes (meta-data).
+// Read 'man 2 stat' and 'man 2 chmod'.
+static void myfs_getattr(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi) {
+  STATS_OP(OP_GETATTR);
+  (void)fi;
+  log_info("myfs_getattr(ino=%lu)\n", (unsigned long)ino);
+  struct stat st;
+  if (isStatsIno(ino)) {
+    statsStat(ino, &st);
+    fuse_reply_attr(req, &st, attrTimeout);
+    return;
   }
-
-  myfcb FCB;
-  nBytes = sizeof(myfcb);
-  for (int i =0;i<count;i++){
-    if (strcmp(dirs[i].name,base) ==0){
-      res = unqlite_kv_fetch(pDb,dirs[i].referencedFCB,KEY_SIZE,&FCB,&nBytes);
-      if (res != UNQLITE_OK || nBytes != sizeof(myfcb)){
-        return -1;
-      }
-      // FCB.mode = mode;
-        FCB.mtime = ubuf->modtime;
-      res = unqlite_kv_store(pDb,dirs[i].referencedFCB,KEY_SIZE,&FCB,sizeof(myfcb));
-      if (res != UNQLITE_OK){
-        return -1;
-      }
-      return 0;
-    }
+  uuid_t uuid;
+  myfcb fcb;
+  int rc = itableLookup(ino, uuid, &fcb);
+  if (rc < 0) {
+    fuse_reply_err(req, -rc);
+    return;
   }
-
-  return -1;
+  fillStat(uuid, &fcb, &st);
+  fuse_reply_attr(req, &st, attrTimeout);
 }
 
-// Write to a file.
-// Read 'man 2 write'
-static int myfs_write(const char *path, const char *buf, size_t size,
-                      off_t offset, struct fuse_file_info *fi) {
-  write_log(
-      "myfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
-      path, buf, size, offset, fi);
-  char copy[strlen(path) + 1];
-  strcpy(copy, path);
-  int rc;
-  uuid_t parUUID;
-  unqlite_int64 nBytes = sizeof(myfcb);
-  char *name = basename(copy);
-  strcpy(copy, path);
-  rc = getParentUUID(&parUUID, path);
-  write_log("write GETS THE PARENT UUID the parent uuid is %s\n",parUUID);
-  if (rc < 0) {
-    return -ENOENT;
-  }
-  myfcb parentFCB;
-  nBytes = sizeof(myfcb);
-  write_log("uuid is %s length of the key is %d nBytes is %d\n",parUUID,KEY_SIZE,nBytes );
-  rc = unqlite_kv_fetch(pDb, parUUID, KEY_SIZE, &parentFCB, &nBytes);
-  if (rc != UNQLITE_OK) {
-    write_log("Fetch Seems to be failing\n");
-    return -1;
-  }
-  int count = parentFCB.size / sizeof(dirent);
-  if (count <1) return -1;
-  dirent dirents[count];
-  nBytes = sizeof(dirent) *count;
-  rc = unqlite_kv_fetch(pDb, parentFCB.file_data_id, KEY_SIZE, &dirents,
-                           &nBytes);
-  if (rc != UNQLITE_OK || nBytes != (sizeof(dirent) * count))return -ENOENT;
+// Change the size of the file whose FCB 'fcb' is stored under 'uuid'.
+static int truncateFile(const uuid_t uuid, myfcb *fcb, off_t newsize) {
+  if (S_ISDIR(fcb->mode)) return -EISDIR;
+  if (newsize == fcb->size) return 0;
+  fcb->mtime = time(NULL);
+  int rc = truncateFileData(uuid, fcb, newsize);
+  if (rc < 0) return rc;
+  log_debug("The file has been resized\n");
+  return 0;
+}
 
-  uuid_t writeUUID;
-  for (int i = 0; i < count;i++){
-    if (strcmp(name,dirents[i].name) ==0){
-      uuid_copy(writeUUID,dirents[i].referencedFCB);
-      break;
-    }
-  }
-  myfcb referencedFCB;
-  nBytes = sizeof(myfcb);
-  rc = unqlite_kv_fetch(pDb, writeUUID,KEY_SIZE,&referencedFCB,&nBytes);
-  if (rc != UNQLITE_OK || nBytes != sizeof(myfcb)) return -1;
-  size_t oldSize = referencedFCB.size;
-  if (offset > oldSize) return -1;
-  write_log("seems to be getting after the setup\n\n");
-
-  char* oldBuffer;
-  char* newBuffer = malloc(offset + size);
-  write_log("Offset %d + size %d is %d\n",offset,size,offset+size);
-  if (oldSize  != 0){
-    write_log("the size is %d\n",oldSize);
-  oldBuffer = malloc(oldSize);
-  nBytes = oldSize;
-  rc = unqlite_kv_fetch(pDb,referencedFCB.file_data_id,KEY_SIZE,oldBuffer,&nBytes);
-  if (rc != UNQLITE_OK || nBytes != oldSize) {
-    free(oldBuffer);
-    free(newBuffer);
-    return -1;
-  }
-}
-  write_log("it gets the old value\n");
-  /*4 cases exist:
-  1.) offset is 0, and the new write size is less than or equal to the old size -> just write it
-  2.) offset is 0, and the new write size if greater than file size, increase the buffer and write it
-  3.) offset isn't 0 and the new write size + offset is less than  or equal to the file size, in which case write it
-  4.) offset isn't 0 and the new write size + offset is greater than the file size extend buffer and copy.
-  */
-  if ((offset + size) <= oldSize){
-    write_log("It goes into less!\n");
-    memcpy(offset+oldBuffer,buf,size);
-    rc = unqlite_kv_store(pDb,referencedFCB.file_data_id,KEY_SIZE,oldBuffer,oldSize);
-    if (rc != UNQLITE_OK) {
-      free(oldBuffer);
-      free(newBuffer);
-      return -1;
-    }
-  } else {
-    write_log("It goes into more\n");
-    if (oldSize != 0){
-      write_log("before the memcpy, oldsize is %d, offset is %d, oldPointer is %p new pointer is %p\n",oldSize,offset,oldBuffer,newBuffer);
-      memcpy(newBuffer,oldBuffer,offset);
-      write_log("After the memcpy\n");
+// Set the attributes 'toSet' says: permissions, ownership, size and the
+// modification time, which is the only time this FS keeps.
+// Read 'man 2 chmod', 'man 2 chown', 'man 2 truncate' and 'man 2 utime'.
+static void myfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                         int toSet, struct fuse_file_info *fi) {
+  STATS_OP(OP_SETATTR);
+  (void)fi;
+  log_info("myfs_setattr(ino=%lu, to_set=0x%x)\n", (unsigned long)ino, toSet);
+  const int changesFCB = FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID |
+                         FUSE_SET_ATTR_GID | FUSE_SET_ATTR_MTIME |
+                         FUSE_SET_ATTR_MTIME_NOW;
+  uuid_t uuid;
+  myfcb fcb;
+  txnEnter();
+  int rc = lockInode(ino, true, uuid, &fcb);
+  if (rc == 0) {
+    if (toSet & FUSE_SET_ATTR_SIZE) {
+      openfile *of = openfileOf(uuid);
+      if (of != NULL)
+        rc = flushDirty(of, &fcb);
+      if (rc == 0)
+        rc = truncateFile(uuid, &fcb, attr->st_size);
     }
-    write_log("Write is failing after original memcpy\n\n");
-    memcpy(newBuffer+offset,buf, size);
-    write_log("Does the memcpy\n");
-    rc = unqlite_kv_store(pDb,referencedFCB.file_data_id,KEY_SIZE,newBuffer,offset+size);
-    if (rc != UNQLITE_OK) {
-      write_log("It borked out writing to the new buffer\n");
-      free(oldBuffer);
-      free(newBuffer);
-      return -1;
+    if (rc == 0 && (toSet & changesFCB)) {
+      if (toSet & FUSE_SET_ATTR_MODE)
+        fcb.mode = (fcb.mode & S_IFMT) | (attr->st_mode & ~S_IFMT);
+      if (toSet & FUSE_SET_ATTR_UID)
+        fcb.uid = attr->st_uid;
+      if (toSet & FUSE_SET_ATTR_GID)
+        fcb.gid = attr->st_gid;
+      if (toSet & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+        fcb.ctime = time(NULL);
+      if (toSet & FUSE_SET_ATTR_MTIME_NOW)
+        fcb.mtime = time(NULL);
+      else if (toSet & FUSE_SET_ATTR_MTIME)
+        fcb.mtime = attr->st_mtime;
+      rc = storeFCB(uuid, &fcb);
     }
-    referencedFCB.size = offset +size;
-    write_log("Sets the new size\n");
+    inodeUnlock(uuid);
   }
-  write_log("after the if statement\n");
-  rc = unqlite_kv_store(pDb,writeUUID,KEY_SIZE,&referencedFCB,sizeof(myfcb));
-  if (rc != UNQLITE_OK) {
-    write_log("error writing the fcb back\n");
-    free(oldBuffer);
-    free(newBuffer);
-    return -1;
-  }
-  if (oldSize != 0)free(oldBuffer);
-  free(newBuffer);
-  write_log("\n\n\nit wrote to a file the size is %d\n\n\n",referencedFCB.size);
-  return size;
-}
-
-// Set the size of a file.
-// Read 'man 2 truncate'.
-int myfs_truncate(const char *path, off_t newsize) {
-  write_log("myfs_truncate(path=\"%s\", newsize=%lld)\n", path, newsize);
-  char copy[strlen(path) + 1];
-  strcpy(copy, path);
-  int rc;
-  uuid_t parUUID;
-  unqlite_int64 nBytes = sizeof(myfcb);
-  char *name = basename(copy);
-  strcpy(copy, path);
-  rc = getParentUUID(&parUUID, path);
-  write_log("write GETS THE PARENT UUID the parent uuid is %s\n",parUUID);
+  txnExit();
   if (rc < 0) {
-    return -ENOENT;
-  }
-  myfcb parentFCB;
-  nBytes = sizeof(myfcb);
-  write_log("uuid is %s length of the key is %d nBytes is %d\n",parUUID,KEY_SIZE,nBytes );
-  rc = unqlite_kv_fetch(pDb, parUUID, KEY_SIZE, &parentFCB, &nBytes);
-  if (rc != UNQLITE_OK) {
-    write_log("Fetch Seems to be failing\n");
-    return -1;
+    fuse_reply_err(req, -rc);
+    return;
   }
-  int count = parentFCB.size / sizeof(dirent);
-  if (count <1) return -1;
-  dirent dirents[count];
-  nBytes = sizeof(dirent) *count;
-  rc = unqlite_kv_fetch(pDb, parentFCB.file_data_id, KEY_SIZE, &dirents,
-                           &nBytes);
-  if (rc != UNQLITE_OK || nBytes != (sizeof(dirent) * count))return -ENOENT;
+  struct stat st;
+  fillStat(uuid, &fcb, &st);
+  fuse_reply_attr(req, &st, attrTimeout);
+}
 
-  uuid_t writeUUID;
-  for (int i = 0; i < count;i++){
-    if (strcmp(name,dirents[i].name) ==0){
-      uuid_copy(writeUUID,dirents[i].referencedFCB);
-      break;
-    }
+// Create a file or directory with mode 'mode' called 'name' in the directory
+// 'parent'. The new inode's uuid and FCB are returned, and the generation of
+// the inode the FCB is current as of.
+static int makeNode(fuse_ino_t parent, const char *name, mode_t mode,
+                    uuid_t uuid, myfcb *fcb, unsigned long *gen) {
+  if (strlen(name) > MY_MAX_NAME)
+    return -ENAMETOOLONG;
+  if (statsEntry(parent, name) != 0)
+    return -EEXIST;
+  uuid_t parUUID;
+  myfcb parentFCB;
+  int rc = lockInode(parent, true, parUUID, &parentFCB);
+  if (rc < 0)
+    return rc;
+  if (!S_ISDIR(parentFCB.mode)) {
+    rc = -ENOTDIR;
+    goto out;
   }
-  myfcb referencedFCB;
-  nBytes = sizeof(myfcb);
-  rc = unqlite_kv_fetch(pDb, writeUUID,KEY_SIZE,&referencedFCB,&nBytes);
-  if (rc != UNQLITE_OK || nBytes != sizeof(myfcb));
-  if (S_ISDIR(referencedFCB.mode)) return -1;
-  if (newsize == referencedFCB.size) return 0;
-  char* oldBuffer;
-  if (referencedFCB.size != 0){
-    oldBuffer = malloc(referencedFCB.size);
-    nBytes = referencedFCB.size;
-    rc = unqlite_kv_fetch(pDb,referencedFCB.file_data_id,KEY_SIZE,oldBuffer,&nBytes);
-    if (rc != UNQLITE_OK || nBytes != referencedFCB.size){
-        free(oldBuffer);
-        return -1;
-    }
+  uuid_t existing;
+  myfcb existingFCB;
+  if (lookupChild(parUUID, name, existing, &existingFCB, NULL) == 0) {
+    rc = -EEXIST;
+    goto out;
   }
-  write_log("The old buffer has/hasn't been created\n");
-  char* buffer = malloc(newsize);
-  write_log("The new Buffer has been created\n");
-
-  if (newsize > referencedFCB.size){
-    if (referencedFCB.size != 0)memcpy((void*) buffer, oldBuffer,referencedFCB.size);
-    memset((buffer + referencedFCB.size),'\0',newsize - referencedFCB.size);
-    write_log("Sets the memory \n");
-    rc = unqlite_kv_store(pDb,referencedFCB.file_data_id,KEY_SIZE,buffer,newsize);
-    if (rc != UNQLITE_OK){
-      free(buffer);
-      if (referencedFCB.size != 0)free(oldBuffer);
-      return -1;
-    }
-    write_log("The file hasbeen written to memory\n");
-
-  } else {
-    rc = unqlite_kv_store(pDb,referencedFCB.file_data_id,KEY_SIZE,oldBuffer,newsize);
-    if (rc != UNQLITE_OK){
-      free(buffer);
-      if (referencedFCB.size != 0)free(oldBuffer);
-      return -1;
-    }
-    write_log("The old buffer has/hasn't been created\n");
 
+  // Size of 0 represents that a directory does not contain any values
+  memset(fcb, 0, sizeof(myfcb));
+  if (S_ISDIR(mode))
+    uuid_copy(fcb->file_data_id, zero_uuid);
+  else
+    uuid_generate(fcb->file_data_id);
+  fcb->size = 0;
+  fcb->ctime = time(NULL);
+  fcb->mtime = time(NULL);
+  fcb->mode = mode;
+  fcb->uid = getuid();
+  fcb->gid = getgid();
+  uuid_generate(uuid);
+  rc = storeFCB(uuid, fcb);
+  if (rc < 0)
+    goto out;
+  log_debug("Stores the new FCB\n");
+
+  rc = addDirent(parUUID, &parentFCB, name, uuid, mode);
+  if (rc == 0) {
+    *gen = inodeGeneration(uuid);
+    dcacheInsert(parUUID, name, uuid, fcb);
   }
-  int oldSize = referencedFCB.size;
-  referencedFCB.size = newsize;
-  rc = unqlite_kv_store(pDb,writeUUID,KEY_SIZE,&referencedFCB,sizeof(myfcb));
+out:
+  inodeUnlock(parUUID);
+  return rc;
+}
 
-  if (rc != UNQLITE_OK){
-    free(buffer);
-    if (referencedFCB.size != 0)free(oldBuffer);
-    return -1;
-  }
-  write_log("The fcb is written to memory\n");
-  if (oldSize != 0)free(oldBuffer);
-  free(buffer);
-  return 0;
+// Create a directory.
+// Read 'man 2 mkdir'.
+static void myfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       mode_t mode) {
+  STATS_OP(OP_MKDIR);
+  log_info("myfs_mkdir(parent=%lu, name=\"%s\")\n", (unsigned long)parent,
+           name);
+  uuid_t uuid;
+  myfcb fcb;
+  unsigned long gen;
+  txnEnter();
+  int rc = makeNode(parent, name, mode | S_IFDIR, uuid, &fcb, &gen);
+  txnExit();
+  replyEntry(req, rc, uuid, &fcb, gen);
+}
 
+// Readdir offsets: "." and ".." are at 1 and 2, an entry is at its cookie
+// plus READDIR_FIRST. An offset is where the next call carries on from.
+#define READDIR_FIRST 3
+
+// An open directory: the segment of its entries holding the first entry past
+// 'offset', so each readdir fetches only the segments it lists from rather
+// than walking from the first entry, and the open directory costs no more
+// memory however big it is. Entries are in cookie order across segments and
+// never move between them, so carrying on from an offset holds however many
+// entries have been added or removed in the meantime. fi->fh holds it.
+typedef struct {
+  uuid_t dataId; // of the entries 'segment' is in
+  uint32_t segment;
+  off_t offset; // of the last entry listed
+} dirhandle;
+
+#define FI_DIRHANDLE(fi) ((dirhandle *)(uintptr_t)(fi)->fh)
+
+// Get the cookie of the first entry of segment 'segment' of the directory
+// 'dir', fetching no more of the segment than that entry's header. An emptied
+// segment has none, and leaves '*empty' set.
+static int firstCookie(const myfcb *dir, uint32_t segment, uint64_t *cookie,
+                       bool *empty) {
+  unsigned char key[CHUNK_KEY_SIZE];
+  char header[DIRENT_HEADER];
+  segmentKey(dir->file_data_id, segment, key);
+  unqlite_int64 nBytes = sizeof(header);
+  int rc = kvFetch(key, CHUNK_KEY_SIZE, header, &nBytes);
+  *empty = rc == UNQLITE_NOTFOUND;
+  if (*empty)
+    return 0;
+  // A segment bigger than the header comes back truncated
+  if ((rc != UNQLITE_OK && rc != UNQLITE_ABORT) || nBytes != sizeof(header))
+    return -EIO;
+  memcpy(cookie, header + KEY_SIZE, sizeof(*cookie));
+  return 0;
 }
 
-// Set permissions.
-// Read 'man 2 chmod'.
-int myfs_chmod(const char *path, mode_t mode) {
-  write_log("myfs_chmod(fpath=\"%s\", mode=0%03o)\n", path, mode);
-  // write_log("mode is %s\n",mode);
-  char name[strlen(path)+1];
-  strcpy(name,path);
-  char*  base = basename(name);
-  uuid_t parUUID;
-  int res = getParentUUID(&parUUID,path);
-  if (res <0) return -1;
-  myfcb parFCB;
-  unqlite_int64 nBytes = sizeof(myfcb);
-  res = unqlite_kv_fetch(pDb,parUUID,KEY_SIZE,&parFCB,&nBytes);
+// Point the handle at the segment of the entries of 'directory', stored under
+// 'uuid' and locked, that holds the first entry past 'offset'. Only an offset
+// the last call did not end at, or entries that were emptied and started
+// again since, cost a look at the first entry of each segment.
+static int dirhandleSeek(dirhandle *dh, const myfcb *directory,
+                         off_t offset) {
+  if (offset == dh->offset &&
+      uuid_compare(dh->dataId, directory->file_data_id) == 0)
+    return 0;
+  uuid_copy(dh->dataId, directory->file_data_id);
+  dh->segment = 0;
+  dh->offset = offset;
+  if (directory->size == 0 || offset < READDIR_FIRST)
+    return 0;
+  uint32_t last;
+  int rc = lastSegment(directory, &last);
+  for (uint32_t s = 0; rc == 0 && s <= last; s++) {
+    uint64_t cookie;
+    bool empty;
+    rc = firstCookie(directory, s, &cookie, &empty);
+    if (rc < 0 || empty)
+      continue;
+    if ((off_t)cookie + READDIR_FIRST > offset)
+      break;
+    dh->segment = s;
+  }
+  return rc;
+}
 
-  if (res != UNQLITE_OK || nBytes != sizeof(myfcb)){
-    return -1;
+// Open a directory.
+// Read 'man 3 opendir'.
+static void myfs_opendir(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi) {
+  STATS_OP(OP_OPENDIR);
+  log_info("myfs_opendir(ino=%lu, fi=%p)\n", (unsigned long)ino, fi);
+  fi->fh = 0;
+  if (ino != STATS_DIR_INO) {
+    dirhandle *dh = calloc(1, sizeof(dirhandle));
+    if (dh == NULL) {
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
+    fi->fh = (uintptr_t)dh;
   }
+  if (fuse_reply_open(req, fi) != 0)
+    free(FI_DIRHANDLE(fi));
+}
 
-  int count = parFCB.size/sizeof(dirent);
+// Release a directory. There will be one call to releasedir for each call to
+// opendir.
+static void myfs_releasedir(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+  STATS_OP(OP_RELEASEDIR);
+  log_info("myfs_releasedir(ino=%lu, fi=%p)\n", (unsigned long)ino, fi);
+  free(FI_DIRHANDLE(fi));
+  fi->fh = 0;
+  fuse_reply_err(req, 0);
+}
+
+// The reply readdir is filling in: 'size' bytes at 'buf', 'used' so far.
+struct readdirReply {
+  fuse_req_t req;
+  char *buf;
+  size_t size;
+  size_t used;
+};
 
-  if (count < 1) return -1;
+// Add an entry to the reply. Returns false, leaving it out, if it is full.
+static bool addReplyEntry(struct readdirReply *reply, const char *name,
+                          const struct stat *st, off_t next) {
+  size_t len = fuse_add_direntry(reply->req, reply->buf + reply->used,
+                                 reply->size - reply->used, name, st, next);
+  if (len > reply->size - reply->used)
+    return false;
+  reply->used += len;
+  return true;
+}
 
-  dirent dirs[count];
-  nBytes = sizeof(dirent) *count;
-  res = unqlite_kv_fetch(pDb,parFCB.file_data_id,KEY_SIZE,&dirs,&nBytes);
+// Add an entry to the reply and move the directory handle past it. Returns
+// false, leaving it out, if the reply is full.
+static bool listEntry(struct readdirReply *reply, dirhandle *dh,
+                      const char *name, const struct stat *st, off_t next) {
+  if (!addReplyEntry(reply, name, st, next))
+    return false;
+  dh->offset = next;
+  return true;
+}
 
-  if (res != UNQLITE_OK || nBytes != sizeof(dirent) *count){
-    return -1;
+// List the statistics directory.
+static void statsReaddir(fuse_req_t req, size_t size, off_t offset) {
+  struct readdirReply reply = {req, malloc(size), size, 0};
+  if (reply.buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
   }
+  struct stat st;
+  statsStat(STATS_DIR_INO, &st);
+  if (offset < 1 && addReplyEntry(&reply, ".", &st, 1))
+    offset = 1;
+  if (offset < 2 && addReplyEntry(&reply, "..", &st, 2))
+    offset = 2;
+  statsStat(STATS_FILE_INO, &st);
+  if (offset == 2)
+    addReplyEntry(&reply, STATS_FILE_NAME, &st, 3);
+  fuse_reply_buf(req, reply.buf, reply.used);
+  free(reply.buf);
+}
 
-  myfcb FCB;
-  nBytes = sizeof(myfcb);
-  for (int i =0;i<count;i++){
-    if (strcmp(dirs[i].name,base) ==0){
-      res = unqlite_kv_fetch(pDb,dirs[i].referencedFCB,KEY_SIZE,&FCB,&nBytes);
-      if (res != UNQLITE_OK || nBytes != sizeof(myfcb)){
-        return -1;
+// Read a directory.
+// Read 'man 2 readdir'. Entries are streamed to FUSE with their offsets, so a
+// large directory is listed a buffer at a time: each call carries on from
+// 'offset', where the directory handle left off, and stops once the buffer is
+// full. Every entry is also added to the dentry cache with its FCB, so the
+// lookup the kernel sends next for each entry of an 'ls -l' is answered
+// without touching the store.
+static void myfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t offset, struct fuse_file_info *fi) {
+  STATS_OP(OP_READDIR);
+  log_info("myfs_readdir(ino=%lu, size=%zu, offset=%lld)\n",
+           (unsigned long)ino, size, (long long)offset);
+  if (ino == STATS_DIR_INO) {
+    statsReaddir(req, size, offset);
+    return;
+  }
+  myfcb directory;
+  uuid_t uuid;
+  int result = lockInode(ino, false, uuid, &directory);
+  if (result < 0) {
+    fuse_reply_err(req, -result);
+    return;
+  }
+  if (!S_ISDIR(directory.mode)) {
+    inodeUnlock(uuid);
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+  // Without a handle from opendir the segments are looked up for this call
+  dirhandle once = {{0}};
+  dirhandle *dh = fi != NULL && fi->fh != 0 ? FI_DIRHANDLE(fi) : &once;
+  struct readdirReply reply = {req, malloc(size), size, 0};
+  if (reply.buf == NULL)
+    result = -ENOMEM;
+  else
+    result = dirhandleSeek(dh, &directory, offset);
+  if (result < 0) {
+    inodeUnlock(uuid);
+    free(reply.buf);
+    fuse_reply_err(req, -result);
+    return;
+  }
+  // Only the type and inode number of an entry reach the kernel
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  st.st_ino = ino;
+  st.st_mode = S_IFDIR;
+  bool full = (offset < 1 && !listEntry(&reply, dh, ".", &st, 1)) ||
+              (offset < 2 && !listEntry(&reply, dh, "..", &st, 2));
+  // The directory cannot change while we hold its lock
+  unsigned long dirGen = inodeGeneration(uuid);
+  uint32_t last = 0;
+  if (directory.size > 0)
+    result = lastSegment(&directory, &last);
+  char segment[DIRENT_SEGMENT_SIZE];
+  for (uint32_t s = dh->segment;
+       !full && result == 0 && directory.size > 0 && s <= last; s++) {
+    size_t len, pos = 0;
+    packedDirent d;
+    result = fetchSegment(&directory, s, segment, &len);
+    while (!full && result == 0 && nextDirent(segment, len, &pos, &d)) {
+      // Listed by an earlier call
+      if ((off_t)d.cookie + READDIR_FIRST <= offset)
+        continue;
+      char name[MY_MAX_NAME + 1];
+      memcpy(name, d.name, d.nameLen);
+      name[d.nameLen] = '\0';
+      unsigned long childGen = inodeGeneration(d.uuid);
+      myfcb child;
+      int rc = fetchFCB(d.uuid, &child);
+      if (rc == 0) {
+        dcacheInsertUnchanged(uuid, name, d.uuid, &child, dirGen, childGen);
+        fillStat(d.uuid, &child, &st);
+      } else {
+        // One unreadable entry must not make the whole directory unlistable:
+        // list it with what the entry itself says
+        log_error("myfs_readdir: FCB of %s is unreadable (%d)\n", name, rc);
+        memset(&st, 0, sizeof(st));
+        st.st_ino = uuidIno(d.uuid);
+        st.st_mode = d.type;
       }
-      FCB.mode = mode;
+      full = !listEntry(&reply, dh, name, &st, d.cookie + READDIR_FIRST);
+      if (!full)
+        dh->segment = s;
+    }
+  }
+  inodeUnlock(uuid);
+  if (result < 0)
+    fuse_reply_err(req, -result);
+  else
+    fuse_reply_buf(req, reply.buf, reply.used);
+  free(reply.buf);
+}
 
-      res = unqlite_kv_store(pDb,dirs[i].referencedFCB,KEY_SIZE,&FCB,sizeof(myfcb));
-      if (res != UNQLITE_OK){
-        return -1;
-      }
-      return 0;
+// Find the entry 'name' of the directory 'parent' and lock both it and the
+// directory exclusively. On success the caller unlocks them with
+// inodeUnlockPair.
+static int lockEntry(fuse_ino_t parent, const char *name, uuid_t parUUID,
+                     myfcb *parFCB, uuid_t uuid, myfcb *fcb) {
+  if (statsEntry(parent, name) != 0)
+    return -EACCES;
+  int rc = itableLookup(parent, parUUID, NULL);
+  if (rc < 0)
+    return rc;
+  for (;;) {
+    rc = lookupChild(parUUID, name, uuid, fcb, NULL);
+    if (rc < 0)
+      return rc;
+    inodeLockPair(parUUID, uuid);
+    // Check that the name still refers to the same inode now that we hold
+    // the locks, and get both FCBs again
+    uuid_t current;
+    rc = itableLookup(parent, parUUID, parFCB);
+    if (rc == 0)
+      rc = indexLookup(parUUID, name, current);
+    if (rc == 0 && uuid_compare(current, uuid) != 0) {
+      inodeUnlockPair(parUUID, uuid);
+      continue;
     }
+    if (rc == 0)
+      rc = fetchFCB(uuid, fcb);
+    if (rc < 0)
+      inodeUnlockPair(parUUID, uuid);
+    return rc;
   }
+}
 
-  return -1;
+// Delete the inode 'uuid', whose FCB is 'fcb', now that no entry refers to
+// it. An open file is deleted on its last release instead. The caller holds
+// its lock exclusively.
+static int deleteInode(const uuid_t uuid, const myfcb *fcb) {
+  if (!S_ISDIR(fcb->mode) && openfileUnlink(uuid))
+    return 0;
+  if (deleteFileData(fcb) < 0 || kvDelete(uuid, KEY_SIZE) != UNQLITE_OK)
+    return -EIO;
+  return 0;
 }
 
-// Set ownership.
-// Read 'man 2 chown'.
-int myfs_chown(const char *path, uid_t uid, gid_t gid) {
-  write_log("myfs_chown(path=\"%s\", uid=%d, gid=%d)\n", path, uid, gid);
-  char name[strlen(path)+1];
-  strcpy(name,path);
-  char*  base = basename(name);
+// Delete a directory.
+// Read 'man 2 rmdir'.
+static void myfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  STATS_OP(OP_RMDIR);
+  log_info("myfs_rmdir(parent=%lu, name=\"%s\")\n", (unsigned long)parent,
+           name);
   uuid_t parUUID;
-  int res = getParentUUID(&parUUID,path);
-  if (res <0) return -1;
   myfcb parFCB;
-  unqlite_int64 nBytes = sizeof(myfcb);
-  res = unqlite_kv_fetch(pDb,parUUID,KEY_SIZE,&parFCB,&nBytes);
-
-  if (res != UNQLITE_OK || nBytes != sizeof(myfcb)){
-    return -1;
+  uuid_t delUUID;
+  myfcb delFCB;
+  txnEnter();
+  int result = lockEntry(parent, name, parUUID, &parFCB, delUUID, &delFCB);
+  if (result == 0) {
+    if (!S_ISDIR(delFCB.mode)) {
+      result = -ENOTDIR;
+    } else if (delFCB.size != 0) {
+      result = -ENOTEMPTY;
+    } else {
+      result = removeDirent(parUUID, &parFCB, name);
+      if (result == 0)
+        result = deleteInode(delUUID, &delFCB);
+    }
+    inodeUnlockPair(parUUID, delUUID);
   }
+  txnExit();
+  fuse_reply_err(req, -result);
+}
 
-  int count = parFCB.size/sizeof(dirent);
 
-  if (count < 1) return -1;
+// Read a file.
+// Read 'man 2 read'.
+static void myfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                      off_t offset, struct fuse_file_info *fi) {
+  STATS_OP(OP_READ);
+  log_debug("myfs_read(ino=%lu, size=%zu, offset=%lld, fi=%p)\n",
+            (unsigned long)ino, size, (long long)offset, fi);
+  if (ino == STATS_FILE_INO) {
+    statsRead(req, size, offset, fi);
+    return;
+  }
+  int rc;
+  uuid_t readUUID;
+  myfcb referencedFCB;
+  rc = lockInode(ino, false, readUUID, &referencedFCB);
+  if (rc < 0) {
+    fuse_reply_err(req, -rc);
+    return;
+  }
+  // Bytes still in the write-back buffer are read from there
+  openfile *of = openfileOf(readUUID);
+  off_t fileSize = referencedFCB.size;
+  if (of != NULL && of->dirtyLen > 0 &&
+      of->dirtyOff + (off_t)of->dirtyLen > fileSize)
+    fileSize = of->dirtyOff + of->dirtyLen;
+  size_t actualsize = 0;
+  char *buf = NULL;
+  if (offset < fileSize) {
+    actualsize = size;
+    if (size + offset > fileSize)
+      actualsize = fileSize - offset;
+    size_t stored = 0;
+    if (offset < referencedFCB.size)
+      stored = actualsize < referencedFCB.size - offset
+                   ? actualsize
+                   : referencedFCB.size - offset;
+    buf = malloc(actualsize);
+    if (buf == NULL)
+      rc = -ENOMEM;
+    else if (stored > 0)
+      rc = readFileData(readUUID, &referencedFCB, buf, stored, offset);
+    if (rc == 0) {
+      memset(buf + stored, 0, actualsize - stored);
+      readDirty(of, buf, actualsize, offset);
+    }
+  }
+  inodeUnlock(readUUID);
+  if (rc < 0) {
+    log_error("fetch of the chunks is failing\n");
+    fuse_reply_err(req, -rc);
+  } else {
+    fuse_reply_buf(req, buf, actualsize);
+  }
+  free(buf);
+}
 
-  dirent dirs[count];
-  nBytes = sizeof(dirent) *count;
-  res = unqlite_kv_fetch(pDb,parFCB.file_data_id,KEY_SIZE,&dirs,&nBytes);
+// Drop an open file's reference to its openfile, writing its write-back
+// buffer first. The last release of a file that was unlinked while open
+// deletes it, buffer and all.
+static int closeFile(openfile *of) {
+  int rc = 0;
+  uuid_t uuid;
+  uuid_copy(uuid, of->uuid);
+  txnEnter();
+  inodeLock(uuid, true);
+  if (!of->unlinked) {
+    myfcb fcb = of->fcb;
+    rc = flushDirty(of, &fcb);
+  }
+  if (openfilePut(of)) {
+    if (deleteFileData(&of->fcb) < 0 ||
+        kvDelete(of->uuid, KEY_SIZE) != UNQLITE_OK)
+      rc = -EIO;
+    dropDirty(of);
+    free(of);
+  }
+  inodeUnlock(uuid);
+  txnExit();
+  return rc;
+}
 
-  if (res != UNQLITE_OK || nBytes != sizeof(dirent) *count){
-    return -1;
+// Write the write-back buffer of the open file 'of', the inode 'ino', to the
+// store. A file that has been unlinked keeps its buffer: nothing will read
+// it from the store again.
+static int flushOpenFile(fuse_ino_t ino, openfile *of) {
+  uuid_t uuid;
+  myfcb fcb;
+  txnEnter();
+  int rc = lockInode(ino, true, uuid, &fcb);
+  if (rc == 0) {
+    if (!of->unlinked)
+      rc = flushDirty(of, &fcb);
+    inodeUnlock(uuid);
   }
+  txnExit();
+  return rc;
+}
 
-  myfcb FCB;
-  nBytes = sizeof(myfcb);
-  for (int i =0;i<count;i++){
-    if (strcmp(dirs[i].name,base) ==0){
-      res = unqlite_kv_fetch(pDb,dirs[i].referencedFCB,KEY_SIZE,&FCB,&nBytes);
-      if (res != UNQLITE_OK || nBytes != sizeof(myfcb)){
-        return -1;
-      }
-      FCB.uid = uid;
-      FCB.gid = gid;
+// Create a file.
+// Read 'man 2 creat'.
+static void myfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        mode_t mode, struct fuse_file_info *fi) {
+  STATS_OP(OP_CREATE);
+  log_info("myfs_create(parent=%lu, name=\"%s\", mode=0%03o)\n",
+           (unsigned long)parent, name, mode);
+  uuid_t uuid;
+  myfcb fcb;
+  unsigned long gen;
+  txnEnter();
+  int rc = makeNode(parent, name, mode, uuid, &fcb, &gen);
+  txnExit();
+
+  // FUSE does not call open after create, so the file is opened here
+  openfile *of = NULL;
+  struct fuse_entry_param e;
+  if (rc == 0 && (of = openfileGet(uuid, &fcb)) == NULL)
+    rc = -ENOMEM;
+  if (rc == 0)
+    rc = makeEntry(uuid, &fcb, gen, &e);
+  if (rc < 0) {
+    if (of != NULL)
+      closeFile(of);
+    fuse_reply_err(req, -rc);
+    return;
+  }
+  fi->fh = (uintptr_t)of;
+  fi->keep_cache = kernelCache;
+  if (fuse_reply_create(req, &e, fi) != 0) {
+    itableForget(e.ino, 1);
+    closeFile(of);
+  }
+}
 
-      res = unqlite_kv_store(pDb,dirs[i].referencedFCB,KEY_SIZE,&FCB,sizeof(myfcb));
-      if (res != UNQLITE_OK){
-        return -1;
-      }
-      return 0;
+// Write to a file.
+// Read 'man 2 write'
+static void myfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                       size_t size, off_t offset, struct fuse_file_info *fi) {
+  STATS_OP(OP_WRITE);
+  log_debug("myfs_write(ino=%lu, buf=%p, size=%zu, offset=%lld, fi=%p)\n",
+            (unsigned long)ino, buf, size, (long long)offset, fi);
+  int rc;
+  uuid_t writeUUID;
+  myfcb referencedFCB;
+  txnEnter();
+  rc = lockInode(ino, true, writeUUID, &referencedFCB);
+  if (rc == 0) {
+    // A small write that continues the buffered range stays in memory;
+    // anything else writes the buffer out first.
+    openfile *of = fi != NULL ? FI_OPENFILE(fi) : NULL;
+    if (of == NULL ||
+        !bufferWrite(of, referencedFCB.size, buf, size, offset)) {
+      if (of != NULL)
+        rc = flushDirty(of, &referencedFCB);
+      if (rc == 0 && (of == NULL || !bufferWrite(of, referencedFCB.size, buf,
+                                                  size, offset)))
+        rc = writeFileData(writeUUID, &referencedFCB, buf, size, offset);
     }
+    if (rc < 0)
+      log_error("It borked out writing the data\n");
+    inodeUnlock(writeUUID);
+  }
+  txnExit();
+  if (rc < 0) {
+    fuse_reply_err(req, -rc);
+    return;
   }
+  log_debug("it wrote to a file the size is %lld\n",
+            (long long)referencedFCB.size);
+  fuse_reply_write(req, size);
+}
 
-  return -1;
+// Write to a file from a buffer vector. This is what FUSE calls for every
+// write once it is set, so with big writes a request of up to max_write bytes
+// reaches writeFileData whole and is applied in a single transaction. The
+// data is only copied when it does not already sit in one memory buffer
+// (spliced from a pipe, say).
+static void myfs_write_buf(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_bufvec *bufv, off_t offset,
+                           struct fuse_file_info *fi) {
+  STATS_OP(OP_WRITE);
+  size_t size = fuse_buf_size(bufv);
+  if (bufv->count == 1 && bufv->idx == 0 && bufv->off == 0 &&
+      !(bufv->buf[0].flags & FUSE_BUF_IS_FD)) {
+    myfs_write(req, ino, bufv->buf[0].mem, size, offset, fi);
+    return;
+  }
+  char *buf = malloc(size);
+  if (buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+  dst.buf[0].mem = buf;
+  ssize_t copied = fuse_buf_copy(&dst, bufv, 0);
+  if (copied < 0)
+    fuse_reply_err(req, (int)-copied);
+  else
+    myfs_write(req, ino, buf, copied, offset, fi);
+  free(buf);
 }
 
 // Delete a file.
 // Read 'man 2 unlink'.
-int myfs_unlink(const char *path) {
-  write_log("myfs_unlink: %s\n", path);
-  write_log("myfs_rmdir: %s\n", path);
-  char copy [strlen(path) +1];
-  strcpy(copy,path);
-  char* rmDir = basename(copy);
+static void myfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  STATS_OP(OP_UNLINK);
+  log_info("myfs_unlink(parent=%lu, name=\"%s\")\n", (unsigned long)parent,
+           name);
   uuid_t parUUID;
-  int result = getParentUUID(&parUUID,path);
   myfcb parFCB;
-  unqlite_int64 nBytes= sizeof(myfcb);
-  result = unqlite_kv_fetch(pDb,parUUID,KEY_SIZE,&parFCB,&nBytes);
-  if (result != UNQLITE_OK || nBytes != sizeof(myfcb)){
-    write_log("The unqlite fetch of the parent fcb failed\n");
-    return result;
-  }
-  bool isRoot = false;
-  if (uuid_compare(ROOT_OBJECT_KEY,parUUID) ==0){
-    isRoot = true;
+  uuid_t delUUID;
+  myfcb delFCB;
+  txnEnter();
+  int result = lockEntry(parent, name, parUUID, &parFCB, delUUID, &delFCB);
+  if (result < 0) goto done;
+  if (S_ISDIR(delFCB.mode)) {
+    result = -EISDIR;
+    goto out;
   }
 
-  int count = parFCB.size/sizeof(dirent);
+  result = removeDirent(parUUID, &parFCB, name);
+  if (result == 0)
+    result = deleteInode(delUUID, &delFCB);
+out:
+  inodeUnlockPair(parUUID, delUUID);
+done:
+  txnExit();
+  fuse_reply_err(req, -result);
+}
 
-  if (count ==0){
-    return -ENOENT;
-  } else {
-    write_log("Gets inside the count not being 0\n");
-    nBytes = sizeof(dirent) * count;
-
-    dirent dirents[count];
-    result = unqlite_kv_fetch(pDb, parFCB.file_data_id, KEY_SIZE, &dirents,
-                             &nBytes);
-    if (result != UNQLITE_OK || nBytes != (sizeof(dirent) * count))return -ENOENT;
-    if (count ==1){
-      myfcb delFCB;
-      nBytes = sizeof(myfcb);
-      result = unqlite_kv_fetch(pDb,dirents[0].referencedFCB,KEY_SIZE,&delFCB,&nBytes);
-      if (result != UNQLITE_OK || nBytes != sizeof(myfcb))return -ENOENT;
-      // if (delFCB.size != 0) return -ENOTEMPTY;
-      if (delFCB.size != 0){
-      result = unqlite_kv_delete(pDb,parFCB.file_data_id,KEY_SIZE);
-      if (result != UNQLITE_OK){
-        return -1;
-      }
-    }
-      uuid_copy(parFCB.file_data_id,zero_uuid);
-      if (isRoot == true){
-        uuid_copy(the_root_fcb.file_data_id,zero_uuid);
-      }
-    } else {
-      int index  =0;
-      for (int i =0;i < count;i++){
-        if (strcmp(rmDir,dirents[i].name) ==0) {
-          index = i;
-          myfcb delFCB;
-          nBytes = sizeof(myfcb);
-          result = unqlite_kv_fetch(pDb,dirents[i].referencedFCB,KEY_SIZE,&delFCB,&nBytes);
-          if (result != UNQLITE_OK || nBytes != sizeof(myfcb))return -ENOENT;
-          if (delFCB.size > 0){
-          result = unqlite_kv_delete(pDb,delFCB.file_data_id,KEY_SIZE);
-          if (result != UNQLITE_OK){
-            return -1;
-          }
-        }
-          break;
-        }
-      }
-      result = unqlite_kv_delete(pDb,dirents[index].referencedFCB,KEY_SIZE);
-      if (result != UNQLITE_OK){
-        return -1;
-      }
-      if (index != (count-1)){
-        strcpy(dirents[index].name,dirents[count-1].name);
-        uuid_copy(dirents[index].referencedFCB,dirents[count-1].referencedFCB);
-      }
-      result = unqlite_kv_store(pDb,parFCB.file_data_id,KEY_SIZE,&dirents,sizeof(dirent) *(count -1));
-      if (result != UNQLITE_OK) return -1;
+// The inodes a rename works on: the entry 'uuid' being moved out of the
+// directory 'parUUID', the directory 'newParUUID' it moves to and, if
+// 'replaces', the entry 'oldUUID' it takes the place of there. 'stripes'
+// are the locks held on all of them.
+struct renameSet {
+  uuid_t parUUID, newParUUID, uuid, oldUUID;
+  myfcb parFCB, newParFCB, fcb, oldFCB;
+  bool replaces;
+  unsigned stripes[4];
+  int nStripes;
+};
+
+// Find the entries 'name' of the directory 'parent', which has to exist, and
+// 'newname' of 'newparent', which may not, and lock them and both
+// directories exclusively. On success the caller unlocks them with
+// inodeUnlockSet.
+static int lockRename(fuse_ino_t parent, const char *name,
+                      fuse_ino_t newparent, const char *newname,
+                      struct renameSet *r) {
+  int rc = itableLookup(parent, r->parUUID, NULL);
+  if (rc == 0)
+    rc = itableLookup(newparent, r->newParUUID, NULL);
+  if (rc < 0)
+    return rc;
+  for (;;) {
+    rc = lookupChild(r->parUUID, name, r->uuid, &r->fcb, NULL);
+    if (rc < 0)
+      return rc;
+    rc = lookupChild(r->newParUUID, newname, r->oldUUID, &r->oldFCB,
+                     NULL);
+    if (rc < 0 && rc != -ENOENT)
+      return rc;
+    r->replaces = rc == 0;
+    const unsigned char *uuids[] = {r->parUUID, r->newParUUID, r->uuid,
+                                    r->oldUUID};
+    r->nStripes = inodeLockSet(uuids, r->replaces ? 4 : 3, r->stripes);
+    // Check that both names still refer to the same inodes now that we hold
+    // the locks, and get the FCBs again
+    uuid_t current;
+    bool changed = false;
+    rc = itableLookup(parent, r->parUUID, &r->parFCB);
+    if (rc == 0)
+      rc = itableLookup(newparent, r->newParUUID, &r->newParFCB);
+    if (rc == 0)
+      rc = indexLookup(r->parUUID, name, current);
+    if (rc == 0) {
+      changed = uuid_compare(current, r->uuid) != 0;
+      rc = indexLookup(r->newParUUID, newname, current);
+      if (rc == 0)
+        changed |= !r->replaces || uuid_compare(current, r->oldUUID) != 0;
+      else if (rc == -ENOENT)
+        changed |= r->replaces;
+      if (rc == -ENOENT)
+        rc = 0;
     }
-    if (isRoot == true){
-      the_root_fcb.size -= sizeof(dirent);
+    if (rc == 0 && changed) {
+      inodeUnlockSet(r->stripes, r->nStripes);
+      continue;
     }
-    parFCB.size -= sizeof(dirent);
-    nBytes = sizeof(myfcb);
-    result = unqlite_kv_store(pDb,parUUID,KEY_SIZE,&parFCB,sizeof(myfcb));
-    if (result != UNQLITE_OK || nBytes != sizeof(myfcb)) return -1;
-  }
-  //TODO
-  //Remove the Record from the parent
-  //Delete the record
-  return 0;
+    if (rc == 0)
+      rc = fetchFCB(r->uuid, &r->fcb);
+    if (rc == 0 && r->replaces)
+      rc = fetchFCB(r->oldUUID, &r->oldFCB);
+    if (rc < 0)
+      inodeUnlockSet(r->stripes, r->nStripes);
+    return rc;
+  }
 }
 
+// Rename a file or directory, replacing whatever 'newname' was.
+// Read 'man 2 rename'. Only directory entries change: the inode keeps its
+// uuid, FCB and data, so a rename costs the same however big the file is,
+// and it reaches the store in a single batch (see txnEnter). The kernel has
+// already refused to move a directory below itself.
+static void myfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        fuse_ino_t newparent, const char *newname) {
+  STATS_OP(OP_RENAME);
+  log_info("myfs_rename(parent=%lu, name=\"%s\", newparent=%lu, "
+           "newname=\"%s\")\n",
+           (unsigned long)parent, name, (unsigned long)newparent, newname);
+  if (strlen(newname) > MY_MAX_NAME) {
+    fuse_reply_err(req, ENAMETOOLONG);
+    return;
+  }
+  if (statsEntry(parent, name) != 0 || statsEntry(newparent, newname) != 0) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+  struct renameSet r;
+  txnEnter();
+  int result = lockRename(parent, name, newparent, newname, &r);
+  if (result < 0) goto done;
+  // Within one directory both names share its FCB
+  myfcb *newParFCB =
+      uuid_compare(r.parUUID, r.newParUUID) == 0 ? &r.parFCB : &r.newParFCB;
+  if (!S_ISDIR(newParFCB->mode)) {
+    result = -ENOTDIR;
+  } else if (r.replaces) {
+    if (uuid_compare(r.uuid, r.oldUUID) == 0)
+      goto out; // Renamed to itself
+    if (S_ISDIR(r.fcb.mode) && !S_ISDIR(r.oldFCB.mode))
+      result = -ENOTDIR;
+    else if (!S_ISDIR(r.fcb.mode) && S_ISDIR(r.oldFCB.mode))
+      result = -EISDIR;
+    else if (S_ISDIR(r.oldFCB.mode) && r.oldFCB.size != 0)
+      result = -ENOTEMPTY;
+    if (result == 0)
+      result = removeDirent(r.newParUUID, newParFCB, newname);
+    if (result == 0)
+      result = deleteInode(r.oldUUID, &r.oldFCB);
+  }
+  if (result == 0)
+    result = removeDirent(r.parUUID, &r.parFCB, name);
+  if (result == 0)
+    result = addDirent(r.newParUUID, newParFCB, newname, r.uuid, r.fcb.mode);
+  if (result == 0) {
+    r.fcb.ctime = time(NULL);
+    result = storeFCB(r.uuid, &r.fcb);
+  }
+  if (result == 0)
+    dcacheInsert(r.newParUUID, newname, r.uuid, &r.fcb);
+out:
+  inodeUnlockSet(r.stripes, r.nStripes);
+done:
+  txnExit();
+  fuse_reply_err(req, -result);
+}
 
-// OPTIONAL - included as an example
-// Flush any cached data.
-int myfs_flush(const char *path, struct fuse_file_info *fi) {
-  int retstat = 0;
-
-  write_log("myfs_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
-
-  return retstat;
+// Flush any cached data: called on every close of a file descriptor.
+static void myfs_flush(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi) {
+  STATS_OP(OP_FLUSH);
+  log_info("myfs_flush(ino=%lu, fi=%p)\n", (unsigned long)ino, fi);
+  openfile *of = ino != STATS_FILE_INO ? FI_OPENFILE(fi) : NULL;
+  int rc = of != NULL ? flushOpenFile(ino, of) : 0;
+  fuse_reply_err(req, -rc);
 }
 
-// OPTIONAL - included as an example
 // Release the file. There will be one call to release for each call to open.
-int myfs_release(const char *path, struct fuse_file_info *fi) {
+static void myfs_release(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi) {
+  STATS_OP(OP_RELEASE);
   int retstat = 0;
 
-  write_log("myfs_release(path=\"%s\", fi=0x%08x)\n", path, fi);
+  log_info("myfs_release(ino=%lu, fi=%p)\n", (unsigned long)ino, fi);
 
-  return retstat;
+  if (ino == STATS_FILE_INO) {
+    free((char *)(uintptr_t)fi->fh);
+  } else {
+    openfile *of = FI_OPENFILE(fi);
+    if (of != NULL)
+      retstat = closeFile(of);
+  }
+  fi->fh = 0;
+  fuse_reply_err(req, -retstat);
 }
 
-// OPTIONAL - included as an example
 // Open a file. Open should check if the operation is permitted for the given
 // flags (fi->flags).
 // Read 'man 2 open'.
-static int myfs_open(const char *path, struct fuse_file_info *fi) {
-  // TODO
-  // if (strcmp(path, the_root_fcb.path) != 0)
-  // 	return -ENOENT;
-
-  write_log("myfs_open(path\"%s\", fi=0x%08x)\n", path, fi);
+static void myfs_open(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi) {
+  STATS_OP(OP_OPEN);
+  log_info("myfs_open(ino=%lu, fi=%p)\n", (unsigned long)ino, fi);
+  if (isStatsIno(ino)) {
+    statsOpen(req, ino, fi);
+    return;
+  }
 
   // return -EACCES if the access is not permitted.
+  uuid_t uuid;
+  myfcb fcb;
+  int rc = lockInode(ino, false, uuid, &fcb);
+  if (rc < 0) {
+    fuse_reply_err(req, -rc);
+    return;
+  }
+  openfile *of = NULL;
+  if (S_ISDIR(fcb.mode)) {
+    rc = -EISDIR;
+  } else {
+    // Every open of the file shares one openfile
+    of = openfileGet(uuid, &fcb);
+    if (of == NULL)
+      rc = -ENOMEM;
+  }
+  inodeUnlock(uuid);
+  if (rc < 0) {
+    fuse_reply_err(req, -rc);
+    return;
+  }
+  fi->fh = (uintptr_t)of;
+  fi->keep_cache = kernelCache;
+  if (fuse_reply_open(req, fi) != 0)
+    closeFile(of);
+}
 
-  return 0;
+// Synchronise a file's contents: write out its write-back buffer and commit
+// the current batch.
+static void myfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                       struct fuse_file_info *fi) {
+  STATS_OP(OP_FSYNC);
+  (void)datasync;
+  log_info("myfs_fsync(ino=%lu, fi=%p)\n", (unsigned long)ino, fi);
+  openfile *of = ino != STATS_FILE_INO ? FI_OPENFILE(fi) : NULL;
+  int rc = of != NULL ? flushOpenFile(ino, of) : 0;
+  if (rc == 0)
+    rc = txnCommit();
+  fuse_reply_err(req, -rc);
+}
+
+// Called by FUSE once the filesystem is mounted (and, unless running in the
+// foreground, daemonised), so this is where our threads are started.
+static void myfs_init(void *userdata, struct fuse_conn_info *conn) {
+  (void)userdata;
+  // Ask for whole writes rather than one page per request
+  conn->want |= conn->capable & FUSE_CAP_BIG_WRITES;
+  if (conn->max_write > MAX_WRITE)
+    conn->max_write = MAX_WRITE;
+  start_log_thread();
+  txnStart();
 }
 
 // This struct contains pointers to all the functions defined above
 // It is used to pass the function pointers to fuse
 // fuse will then execute the methods as required
-static struct fuse_operations myfs_oper = {
+static struct fuse_lowlevel_ops myfs_oper = {
+    .init = myfs_init,
+    .lookup = myfs_lookup,
+    .forget = myfs_forget,
     .getattr = myfs_getattr,
+    .setattr = myfs_setattr,
+    .opendir = myfs_opendir,
     .readdir = myfs_readdir,
+    .releasedir = myfs_releasedir,
     .mkdir = myfs_mkdir,
     .rmdir = myfs_rmdir,
     .open = myfs_open,
     .read = myfs_read,
     .create = myfs_create,
-    .utime = myfs_utime,
     .write = myfs_write,
-    .truncate = myfs_truncate,
+    .write_buf = myfs_write_buf,
     .flush = myfs_flush,
+    .fsync = myfs_fsync,
     .release = myfs_release,
-    .chmod = myfs_chmod,
     .unlink = myfs_unlink,
+    .rename = myfs_rename,
+};
+
+// Read the entries of the directory 'dir' as stored by format 'version', one
+// older than FORMAT_VERSION, into an array of dirent structs. The caller frees
+// '*dirents'.
+static int fetchOldDirents(const myfcb *dir, int version, dirent **dirents,
+                           int *count) {
+  *dirents = NULL;
+  *count = 0;
+  if (dir->size == 0)
+    return 0;
+  char *raw = malloc(dir->size);
+  if (raw == NULL)
+    return -ENOMEM;
+  unqlite_int64 nBytes = dir->size;
+  if (unqlite_kv_fetch(pDb, dir->file_data_id, KEY_SIZE, raw, &nBytes) !=
+          UNQLITE_OK ||
+      nBytes != dir->size) {
+    free(raw);
+    return -EIO;
+  }
+  if (version < 4) {
+    *dirents = (dirent *)raw;
+    *count = dir->size / sizeof(dirent);
+    return 0;
+  }
+  // Version 4: the child's uuid, its file type, the name length and the name
+  const size_t header = KEY_SIZE + 2;
+  *dirents = calloc(dir->size / (header + 1), sizeof(dirent));
+  if (*dirents == NULL) {
+    free(raw);
+    return -ENOMEM;
+  }
+  for (size_t pos = 0; pos + header <= dir->size;) {
+    size_t nameLen = (unsigned char)raw[pos + header - 1];
+    if (pos + header + nameLen > dir->size)
+      break;
+    dirent *d = &(*dirents)[(*count)++];
+    memcpy(d->referencedFCB, raw + pos, KEY_SIZE);
+    memcpy(d->name, raw + pos + header, nameLen);
+    pos += header + nameLen;
+  }
+  free(raw);
+  return 0;
+}
+
+// Upgrade everything below the directory 'dir' stored under 'dirUUID' from
+// format 'version', older than 5, to format 5 in a single walk of the tree:
+//   0 -> 1: regular files move from one blob under their file_data_id into
+//           CHUNK_SIZE chunks.
+//   1 -> 2: every directory gets a name index, which is left to
+//           segmentDirents as it indexes every name afresh.
+//   2 -> 3: files of up to INLINE_DATA_MAX bytes move from chunk 0 into their
+//           FCB record.
+//   3 -> 4: directory entries are packed.
+//   4 -> 5: directory entries get readdir cookies.
+static int upgradeTree(const uuid_t dirUUID, const myfcb *dir, int version) {
+  dirent *dirents;
+  int count;
+  int rc = fetchOldDirents(dir, version, &dirents, &count);
+  if (rc < 0 || count == 0)
+    return rc;
+  char *packed = malloc(direntSize(MY_MAX_NAME) * count);
+  size_t packedLen = 0;
+  if (packed == NULL) {
+    free(dirents);
+    return -ENOMEM;
+  }
+  unqlite_int64 nBytes;
+  for (int i = 0; i < count && rc == 0; i++) {
+    myfcb child;
+    if (version < 3) {
+      // Before version 3 every FCB record is a bare myfcb
+      nBytes = sizeof(myfcb);
+      if (unqlite_kv_fetch(pDb, dirents[i].referencedFCB, KEY_SIZE, &child,
+                           &nBytes) != UNQLITE_OK ||
+          nBytes != sizeof(myfcb))
+        rc = -EIO;
+    } else {
+      rc = fetchFCB(dirents[i].referencedFCB, &child);
+    }
+    uint64_t cookie;
+    if (rc == 0)
+      rc = takeCookie(&cookie);
+    if (rc < 0)
+      break;
+    packedLen += packDirent(packed + packedLen, dirents[i].name,
+                            dirents[i].referencedFCB, cookie, child.mode);
+    if (S_ISDIR(child.mode)) {
+      rc = upgradeTree(dirents[i].referencedFCB, &child, version);
+    } else if (version < 1 && child.size > 0) {
+      char *blob = malloc(child.size);
+      nBytes = child.size;
+      if (blob == NULL || unqlite_kv_fetch(pDb, child.file_data_id, KEY_SIZE,
+                                           blob, &nBytes) != UNQLITE_OK) {
+        rc = -EIO;
+      } else {
+        // writeFileData grows the size from zero as it goes
+        child.size = 0;
+        rc = writeFileData(dirents[i].referencedFCB, &child, blob, nBytes, 0);
+        if (rc == 0 &&
+            unqlite_kv_delete(pDb, child.file_data_id, KEY_SIZE) != UNQLITE_OK)
+          rc = -EIO;
+      }
+      free(blob);
+    } else if (version < 3 && isInline(&child) && child.size > 0) {
+      unsigned char key[CHUNK_KEY_SIZE];
+      char data[INLINE_DATA_MAX];
+      chunkKey(child.file_data_id, 0, key);
+      nBytes = child.size;
+      rc = unqlite_kv_fetch(pDb, key, CHUNK_KEY_SIZE, data, &nBytes);
+      if (rc == UNQLITE_NOTFOUND) {
+        nBytes = 0;
+      } else if (rc != UNQLITE_OK) {
+        rc = -EIO;
+        break;
+      }
+      memset(data + nBytes, 0, child.size - nBytes);
+      rc = storeRecord(dirents[i].referencedFCB, &child, data);
+      if (rc == 0 && unqlite_kv_delete(pDb, key, CHUNK_KEY_SIZE) != UNQLITE_OK)
+        rc = -EIO;
+    }
+  }
+  if (rc == 0) {
+    if (unqlite_kv_store(pDb, dir->file_data_id, KEY_SIZE, packed,
+                         packedLen) != UNQLITE_OK) {
+      rc = -EIO;
+    } else {
+      myfcb packedDir = *dir;
+      packedDir.size = packedLen;
+      rc = storeFCB(dirUUID, &packedDir);
+    }
+  }
+  free(dirents);
+  free(packed);
+  return rc;
+}
+
+// Upgrade the directory 'dir' stored under 'dirUUID', and every directory
+// below it, from format 6: split its entries, kept in a single record under
+// its file_data_id, into segments, and index each name with its segment.
+static int segmentDirents(const uuid_t dirUUID, const myfcb *dir) {
+  if (dir->size == 0)
+    return 0;
+  char *packed = malloc(dir->size);
+  if (packed == NULL)
+    return -ENOMEM;
+  unqlite_int64 nBytes = dir->size;
+  int rc = 0;
+  if (unqlite_kv_fetch(pDb, dir->file_data_id, KEY_SIZE, packed, &nBytes) !=
+          UNQLITE_OK ||
+      (size_t)nBytes != dir->size)
+    rc = -EIO;
+  // The old index entries have no segment: drop them all first, as names that
+  // share a bucket would otherwise lose each other's new entries
+  size_t pos = 0;
+  packedDirent d;
+  char name[MY_MAX_NAME + 1];
+  unsigned char key[INDEX_KEY_SIZE > CHUNK_KEY_SIZE ? INDEX_KEY_SIZE
+                                                    : CHUNK_KEY_SIZE];
+  while (rc == 0 && nextDirent(packed, dir->size, &pos, &d)) {
+    memcpy(name, d.name, d.nameLen);
+    name[d.nameLen] = '\0';
+    indexKey(dirUUID, name, key);
+    int drc = unqlite_kv_delete(pDb, key, INDEX_KEY_SIZE);
+    if (drc != UNQLITE_OK && drc != UNQLITE_NOTFOUND)
+      rc = -EIO;
+  }
+  size_t start = 0;
+  uint32_t segment = 0;
+  pos = 0;
+  while (rc == 0 && nextDirent(packed, dir->size, &pos, &d)) {
+    size_t entry = pos - direntSize(d.nameLen);
+    if (pos - start > DIRENT_SEGMENT_SIZE) {
+      segmentKey(dir->file_data_id, segment++, key);
+      if (unqlite_kv_store(pDb, key, CHUNK_KEY_SIZE, packed + start,
+                           entry - start) != UNQLITE_OK)
+        rc = -EIO;
+      start = entry;
+    }
+    memcpy(name, d.name, d.nameLen);
+    name[d.nameLen] = '\0';
+    if (rc == 0)
+      rc = indexInsert(dirUUID, name, d.uuid, segment);
+    if (rc == 0 && S_ISDIR(d.type)) {
+      myfcb child;
+      rc = fetchFCB(d.uuid, &child);
+      if (rc == 0)
+        rc = segmentDirents(d.uuid, &child);
+    }
+  }
+  if (rc == 0) {
+    segmentKey(dir->file_data_id, segment, key);
+    if (unqlite_kv_store(pDb, key, CHUNK_KEY_SIZE, packed + start,
+                         pos - start) != UNQLITE_OK ||
+        unqlite_kv_store(pDb, dir->file_data_id, KEY_SIZE, &segment,
+                         sizeof(segment)) != UNQLITE_OK)
+      rc = -EIO;
+  }
+  free(packed);
+  return rc;
+}
+
+// The subdirectories countSubdirs has found in a directory.
+struct subdirList {
+  uuid_t *uuids;
+  size_t count;
+  size_t cap;
+  bool failed;
 };
 
+// walkDirents visitor for countSubdirs: collect the subdirectories.
+static int collectSubdir(const packedDirent *d, void *arg) {
+  struct subdirList *list = arg;
+  if (!S_ISDIR(d->type))
+    return 0;
+  if (list->count == list->cap) {
+    size_t cap = list->cap ? 2 * list->cap : 16;
+    uuid_t *uuids = realloc(list->uuids, cap * sizeof(uuid_t));
+    if (uuids == NULL) {
+      list->failed = true;
+      return 1;
+    }
+    list->uuids = uuids;
+    list->cap = cap;
+  }
+  memcpy(list->uuids[list->count++], d->uuid, KEY_SIZE);
+  return 0;
+}
+
+// Upgrade the directory 'dir' stored under 'dirUUID', and every directory
+// below it, from format 5: count their subdirectories.
+static int countSubdirs(const uuid_t dirUUID, const myfcb *dir) {
+  struct subdirList list = {NULL};
+  int rc = walkDirents(dir, collectSubdir, &list);
+  if (rc == 0 && list.failed)
+    rc = -ENOMEM;
+  for (size_t i = 0; rc == 0 && i < list.count; i++) {
+    myfcb child;
+    rc = fetchFCB(list.uuids[i], &child);
+    if (rc == 0)
+      rc = countSubdirs(list.uuids[i], &child);
+  }
+  if (rc == 0) {
+    myfcb counted = *dir;
+    counted.subdirs = list.count;
+    rc = storeFCB(dirUUID, &counted);
+  }
+  free(list.uuids);
+  return rc;
+}
+
+// Bring a database written by an older version of myfs up to FORMAT_VERSION.
+static void upgradeFormat() {
+  int version = 0;
+  unqlite_int64 nBytes = sizeof(version);
+  int rc = unqlite_kv_fetch(pDb, FORMAT_KEY, KEY_SIZE, &version, &nBytes);
+  if (rc != UNQLITE_OK && rc != UNQLITE_NOTFOUND)
+    error_handler(rc);
+  if (version == FORMAT_VERSION)
+    return;
+  if (version > FORMAT_VERSION) {
+    printf("Database format %d is newer than this myfs (%d).\n", version,
+           FORMAT_VERSION);
+    exit(-1);
+  }
+  printf("init_fs: upgrading database format %d to %d\n", version,
+         FORMAT_VERSION);
+  const unsigned char *root = (const unsigned char *)ROOT_OBJECT_KEY;
+  rc = version < 5 ? upgradeTree(root, &the_root_fcb, version) : 0;
+  // upgradeTree stores the root FCB it changes in the_root_fcb
+  myfcb dir = the_root_fcb;
+  if (rc == 0 && version < 7)
+    rc = segmentDirents(root, &dir);
+  if (rc == 0 && version < 6)
+    rc = countSubdirs(root, &dir);
+  if (rc < 0) {
+    printf("init_fs: could not upgrade the database\n");
+    exit(-1);
+  }
+  version = FORMAT_VERSION;
+  rc = unqlite_kv_store(pDb, FORMAT_KEY, KEY_SIZE, &version, sizeof(version));
+  if (rc != UNQLITE_OK)
+    error_handler(rc);
+}
+
 // Initialise the in-memory data structures from the store. If the root object
 // (from the store) is empty then create a root fcb (directory)
 // and write it to the store. Note that this code is executed outide of fuse. If
@@ -1093,10 +3260,12 @@ static struct fuse_operations myfs_oper = {
 void init_fs() {
   int rc;
   printf("init_fs\n");
+  initInodeLocks();
   // Open the database.
   rc = unqlite_open(&pDb, DATABASE_NAME, UNQLITE_OPEN_CREATE);
   if (rc != UNQLITE_OK)
     error_handler(rc);
+  initCookies();
 
   unqlite_int64 nBytes = sizeof(myfcb); // Data length
 
@@ -1131,6 +3300,13 @@ void init_fs() {
 
     if (rc != UNQLITE_OK)
       error_handler(rc);
+
+    // A fresh database is always written in the current format
+    int version = FORMAT_VERSION;
+    rc = unqlite_kv_store(pDb, FORMAT_KEY, KEY_SIZE, &version,
+                          sizeof(version));
+    if (rc != UNQLITE_OK)
+      error_handler(rc);
   } else {
     if (rc == UNQLITE_OK) {
       printf("init_store: root object was found\n");
@@ -1139,14 +3315,97 @@ void init_fs() {
       printf("Data object has unexpected size. Doing nothing.\n");
       exit(-1);
     }
+    upgradeFormat();
   }
 }
 
-void shutdown_fs() { unqlite_close(pDb); }
+void shutdown_fs() {
+  txnStop();
+  stop_log();
+  dcacheReport(logfile);
+  unqlite_close(pDb);
+}
+
+// Our own mount options, e.g. "-o log_level=info". Everything else is left for
+// FUSE.
+struct myfs_config {
+  char *logLevel;
+  long commitIntervalMs;
+  unsigned long long commitBytes;
+  double attrTimeout;
+  double entryTimeout;
+  double negativeTimeout;
+  int kernelCache;
+};
+
+// Options that are not given stay negative
+static struct myfs_config myfs_conf = {
+    .attrTimeout = -1,
+    .entryTimeout = -1,
+    .negativeTimeout = -1,
+    .kernelCache = -1,
+};
+
+#define MYFS_OPT(t, p) {t, offsetof(struct myfs_config, p), 0}
+#define MYFS_FLAG(t, p, v) {t, offsetof(struct myfs_config, p), v}
+
+static struct fuse_opt myfs_opts[] = {
+    MYFS_OPT("log_level=%s", logLevel),
+    MYFS_OPT("commit_interval_ms=%ld", commitIntervalMs),
+    MYFS_OPT("commit_bytes=%llu", commitBytes),
+    MYFS_OPT("attr_timeout=%lf", attrTimeout),
+    MYFS_OPT("entry_timeout=%lf", entryTimeout),
+    MYFS_OPT("negative_timeout=%lf", negativeTimeout),
+    MYFS_FLAG("kernel_cache", kernelCache, 1),
+    MYFS_FLAG("no_kernel_cache", kernelCache, 0),
+    FUSE_OPT_END,
+};
+
+// Apply the parsed mount options. Returns -1 if one of them is invalid.
+static int apply_config() {
+  if (myfs_conf.logLevel != NULL) {
+    static const char *levels[] = {"off", "error", "info", "debug"};
+    int level;
+    for (level = MYFS_LOG_OFF; level <= MYFS_LOG_DEBUG; level++) {
+      if (strcmp(myfs_conf.logLevel, levels[level]) == 0)
+        break;
+    }
+    if (level > MYFS_LOG_DEBUG) {
+      fprintf(stderr, "myfs: log_level must be off, error, info or debug\n");
+      return -1;
+    }
+    myfs_log_level = level;
+  }
+  if (myfs_conf.commitIntervalMs > 0)
+    commitIntervalMs = myfs_conf.commitIntervalMs;
+  if (myfs_conf.commitBytes > 0)
+    commitBytes = myfs_conf.commitBytes;
+  if (myfs_conf.attrTimeout >= 0)
+    attrTimeout = myfs_conf.attrTimeout;
+  if (myfs_conf.entryTimeout >= 0)
+    entryTimeout = myfs_conf.entryTimeout;
+  if (myfs_conf.negativeTimeout >= 0)
+    negativeTimeout = myfs_conf.negativeTimeout;
+  if (myfs_conf.kernelCache >= 0)
+    kernelCache = myfs_conf.kernelCache;
+  return 0;
+}
 
 int main(int argc, char *argv[]) {
-  int fuserc;
+  int fuserc = -1;
   struct myfs_state *myfs_internal_state;
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  char *mountpoint = NULL;
+  int multithreaded, foreground;
+
+  if (fuse_opt_parse(&args, &myfs_conf, myfs_opts, NULL) == -1 ||
+      apply_config() < 0 ||
+      fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) ==
+          -1)
+    return 1;
+  // Without a thread-safe UnQLite the handlers have to run one at a time
+  if (!unqlite_lib_is_threadsafe())
+    multithreaded = 0;
 
   // Setup the log file and store the FILE* in the private data object for the
   // file system.
@@ -1157,15 +3416,31 @@ int main(int argc, char *argv[]) {
   // debugging.
   init_fs();
 
-  // Now pass our function pointers over to FUSE, so they can be called whenever
-  // someone
-  // tries to interact with our filesystem. The internal state contains a file
-  // handle
-  // for the logging mechanism
-  fuserc = fuse_main(argc, argv, &myfs_oper, myfs_internal_state);
+  // Now mount the filesystem and pass our function pointers over to FUSE, so
+  // they can be called whenever someone tries to interact with our
+  // filesystem, until it is unmounted.
+  struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+  if (ch != NULL) {
+    struct fuse_session *se = fuse_lowlevel_new(
+        &args, &myfs_oper, sizeof(myfs_oper), myfs_internal_state);
+    if (se != NULL) {
+      if (fuse_set_signal_handlers(se) == 0) {
+        fuse_session_add_chan(se, ch);
+        fuse_daemonize(foreground);
+        fuserc = multithreaded ? fuse_session_loop_mt(se)
+                               : fuse_session_loop(se);
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+  }
 
   // Shutdown the file system.
   shutdown_fs();
+  fuse_opt_free_args(&args);
+  free(mountpoint);
 
-  return fuserc;
+  return fuserc == 0 ? 0 : 1;
 }
@@ -8,9 +8,13 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <time.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #define MY_MAX_PATH 100
 #define MY_MAX_FILE_SIZE 1000
 
@@ -33,6 +37,8 @@ typedef struct _myfcb {
     uid_t  uid;     /* user */
     gid_t  gid;     /* group */
     mode_t mode;    /* protection */
+    // Fills what was padding, so records kept their size in format 6
+    uint32_t subdirs; /* subdirectories of a directory, for st_nlink */
     time_t mtime;   /* time of last modification */
     time_t ctime;   /* time of last change to meta-data (status) */
     off_t size;     /* size */
@@ -44,6 +50,33 @@ typedef struct _myfcb {
     // time_t root_mtime;  /* time of last modification */
 } myfcb;
 
+// A directory's entries are packed one after another: the child's FCB uuid,
+// the entry's 64 bit readdir cookie, its file type (the S_IFMT bits of its
+// mode shifted down by 12), the length of its name and the name itself,
+// without a terminating NUL. The size of a directory is the length of its
+// entries.
+#define DIRENT_HEADER (KEY_SIZE + sizeof(uint64_t) + 2)
+#define MY_MAX_NAME 255
+
+// The entries are split into segments of up to DIRENT_SEGMENT_SIZE bytes, each
+// stored like a file chunk: under the directory's file_data_id followed by the
+// segment number. The record under file_data_id itself holds the number of
+// the last segment, as a uint32_t. An entry is appended to the last segment,
+// or starts a new one if it does not fit, and never moves; removing it
+// rewrites only its own segment, and deletes a segment it leaves empty. So
+// adding or removing an entry, or listing part of a directory, costs a
+// segment rather than the whole directory.
+#define DIRENT_SEGMENT_SIZE 4096
+
+// Readdir cookies come from one counter for the whole filesystem, so they
+// grow in the order entries are added and a directory's entries are always
+// in cookie order. The counter is kept under its own well-known key, which
+// is advanced a batch of cookies at a time.
+#define COOKIE_KEY "MyDirentCookies"
+#define COOKIE_BATCH 65536
+
+// Up to format version 3 entries were stored as an array of fixed size
+// structs instead, and version 4 packed them without cookies.
 typedef struct entry{
   char name[256];
   uuid_t referencedFCB;
@@ -63,6 +96,103 @@ extern unqlite_int64 root_object_size_value;
 // database. We use uuids as keys, so 16 bytes each
 #define KEY_SIZE 16
 
+// File contents are split into fixed size chunks. Each chunk is stored under
+// its own key: the file's data uuid followed by the chunk number, so a write
+// only has to fetch and store the chunks it overlaps.
+#define CHUNK_SIZE (64 * 1024)
+#define CHUNK_KEY_SIZE (KEY_SIZE + sizeof(uint64_t))
+
+// Regular files of up to this many bytes are not split into chunks at all:
+// their data is kept in the FCB record itself, right after the myfcb, so
+// reading or writing a small file costs a single fetch or store.
+#define INLINE_DATA_MAX 2048
+
+// Largest write the kernel is asked to send in a single request (big writes
+// are enabled at init). The FUSE channel buffer caps it at 128 KiB anyway;
+// -o max_write=... can lower it.
+#define MAX_WRITE (128 * 1024)
+
+// Every directory keeps a name index next to its entries, so a lookup does
+// not have to scan them. The index has one record per hashed name, keyed by
+// the directory's FCB uuid followed by the 64 bit hash of the name. A record
+// holds one entry per name with that hash (nearly always just one): the
+// child's FCB uuid, the 32 bit number of the segment holding its dirent, a
+// 16 bit name length and the name itself.
+#define INDEX_KEY_SIZE (KEY_SIZE + sizeof(uint64_t))
+#define INDEX_ENTRY_SEGMENT KEY_SIZE
+#define INDEX_ENTRY_NAMELEN (INDEX_ENTRY_SEGMENT + sizeof(uint32_t))
+#define INDEX_ENTRY_HEADER (INDEX_ENTRY_NAMELEN + sizeof(uint16_t))
+// Buffer size first used to fetch an index record, enough for one entry
+#define INDEX_BUCKET_GUESS 512
+
+// Bounds of the in-memory dentry cache used by path resolution. The number of
+// buckets must be a power of two.
+#define DCACHE_BUCKETS 4096
+#ifndef DCACHE_MAX_ENTRIES
+#define DCACHE_MAX_ENTRIES 16384
+#endif
+
+// Number of hash buckets of the open file table, a power of two.
+#define OPENFILE_BUCKETS 256
+
+// Small writes to an open file are gathered in a write-back buffer of up to
+// WRITEBACK_MAX bytes while each one continues the buffered range, and reach
+// the store together on flush, release, fsync or truncate, or when a write
+// does not continue the range. The buffers of all open files hold at most
+// WRITEBACK_LIMIT bytes between them; past that, writes go straight through.
+#define WRITEBACK_MAX CHUNK_SIZE
+#define WRITEBACK_LIMIT (64 * 1024 * 1024)
+
+// Number of hash buckets of the inode table, a power of two.
+#define ITABLE_BUCKETS 4096
+
+// Number of per-inode reader/writer locks, a power of two. Inodes are
+// spread over them by uuid.
+#define INODE_LOCK_STRIPES 1024
+
+// Runtime statistics are read from a hidden file, /.myfs/stats, which
+// exists in memory only: it is not listed in the root directory, and a
+// stored entry of the same name is hidden by it. Its directory and the file
+// have fixed inode numbers; those of stored inodes come from random uuids
+// (see uuidIno), whose version bits keep them far above these.
+#define STATS_DIR_NAME ".myfs"
+#define STATS_FILE_NAME "stats"
+#define STATS_DIR_INO 2
+#define STATS_FILE_INO 3
+
+// Operation latencies are kept in nanoseconds in log-linear histograms:
+// 2^STATS_SUB_BITS buckets per power of two, so a bucket is at most 12.5%
+// wide. Latencies beyond the last bucket, about a minute, are counted in
+// it.
+#define STATS_SUB_BITS 3
+#define STATS_BUCKETS 272
+
+// Default group commit thresholds: a batch of operations is committed once
+// it is this old or has written this many bytes to the store. Both can be
+// changed with -o commit_interval_ms=...,commit_bytes=...
+#define COMMIT_INTERVAL_MS 5
+#define COMMIT_BYTES (4 * 1024 * 1024)
+
+// myfs is the only writer of its database and every change reaches it
+// through the kernel, so the kernel may cache attributes, names and missing
+// names for as long as it likes, and keep file pages across opens. These are
+// the defaults, in seconds, which -o attr_timeout=...,entry_timeout=...,
+// negative_timeout=... override; -o no_kernel_cache turns off the page cache
+// across opens.
+#define ATTR_TIMEOUT 60.0
+#define ENTRY_TIMEOUT 60.0
+#define NEGATIVE_TIMEOUT 60.0
+
+// The on-disk layout version is stored under its own well-known key so that
+// databases written by older versions can be upgraded when they are mounted.
+// Version 0 (no key) stored each file as a single blob under file_data_id,
+// version 1 had no directory name index, version 2 kept small files in
+// chunks like any other, version 3 did not pack directory entries, version
+// 4 gave them no readdir cookies, version 5 did not count a directory's
+// subdirectories and version 6 kept a directory's entries in a single record.
+#define FORMAT_KEY "MyFormatVersion"
+#define FORMAT_VERSION 7
+
 // The name of the file which will hold our filesystem
 // If things get corrupted, unmount it and delete the file
 // to start over with a fresh filesystem
@@ -74,7 +204,6 @@ extern void error_handler(int);
 void print_id(uuid_t *);
 
 extern FILE* init_log_file();
-extern void write_log(const char *, ...);
 
 extern uuid_t zero_uuid;
 
@@ -83,7 +212,6 @@ extern uuid_t zero_uuid;
 struct myfs_state {
     FILE *logfile;
 };
-#define NEWFS_PRIVATE_DATA ((struct myfs_state *) fuse_get_context()->private_data)
 
 
 
@@ -92,8 +220,53 @@ struct myfs_state {
 
 // In order to log actions while running through FUSE, we have to give
 // it a file handle to use. We define a couple of helper functions to do
-// logging. No need to change this if you don't see a need
+// logging.
 //
+// Logging must not slow the filesystem down, so messages are filtered twice:
+// levels above MYFS_LOG_MAX_LEVEL are compiled out entirely, and levels above
+// the runtime level (-o log_level=..., errors only by default) cost a single
+// comparison. Messages that pass are formatted into a lock-free ring buffer
+// and written to the log file by a background thread, so a handler never
+// waits for the file. If the ring is full the message is dropped and counted.
+
+#define MYFS_LOG_OFF 0
+#define MYFS_LOG_ERROR 1 /* failures */
+#define MYFS_LOG_INFO 2  /* one line per operation */
+#define MYFS_LOG_DEBUG 3 /* internal chatter of the data path */
+
+#ifndef MYFS_LOG_MAX_LEVEL
+#define MYFS_LOG_MAX_LEVEL MYFS_LOG_DEBUG
+#endif
+
+// Ring size in messages (a power of two) and longest message kept
+#define LOG_RING_SLOTS 1024
+#define LOG_LINE_MAX 256
+
+int myfs_log_level = MYFS_LOG_ERROR;
+
+#define log_at(level, ...)                                                     \
+  do {                                                                         \
+    if ((level) <= MYFS_LOG_MAX_LEVEL && (level) <= myfs_log_level)            \
+      log_message(__VA_ARGS__);                                                \
+  } while (0)
+#define log_error(...) log_at(MYFS_LOG_ERROR, __VA_ARGS__)
+#define log_info(...) log_at(MYFS_LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(MYFS_LOG_DEBUG, __VA_ARGS__)
+
+// A bounded multi-producer queue: a slot may be filled by the producer that
+// claimed its position once its sequence number equals that position, and
+// drained by the log thread once it is one past it.
+struct logSlot {
+    atomic_size_t seq;
+    char msg[LOG_LINE_MAX];
+};
+
+static struct logSlot logRing[LOG_RING_SLOTS];
+static atomic_size_t logEnqueuePos;
+static size_t logDequeuePos;
+static atomic_ulong logDropped;
+static atomic_bool logRunning;
+static pthread_t logThread;
 
 FILE *logfile;
 
@@ -105,16 +278,88 @@ FILE *init_log_file(){
 		perror("Unable to open log file. Life is not worth living.");
 		exit(EXIT_FAILURE);
     }
-    //Use line buffering
-    setvbuf(logfile, NULL, _IOLBF, 0);
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++) {
+        atomic_init(&logRing[i].seq, i);
+    }
     return logfile;
 }
 
-// Write to the provided handle
-void write_log(const char *format, ...){
+// Queue a message for the log thread. Never blocks.
+__attribute__((format(printf, 1, 2)))
+static void log_message(const char *format, ...){
+    size_t pos = atomic_load_explicit(&logEnqueuePos, memory_order_relaxed);
+    struct logSlot *slot;
+    for (;;) {
+        slot = &logRing[pos & (LOG_RING_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&logEnqueuePos, &pos,
+                    pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // Full: the log thread is behind
+            atomic_fetch_add_explicit(&logDropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&logEnqueuePos, memory_order_relaxed);
+        }
+    }
     va_list ap;
     va_start(ap, format);
-    vfprintf(NEWFS_PRIVATE_DATA->logfile, format, ap);
+    vsnprintf(slot->msg, LOG_LINE_MAX, format, ap);
+    va_end(ap);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+// Write out every queued message. Only the log thread (or shutdown, once it
+// has stopped) drains the ring.
+static int drain_log(){
+    int written = 0;
+    for (;;) {
+        struct logSlot *slot = &logRing[logDequeuePos & (LOG_RING_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != logDequeuePos + 1)
+            break;
+        fputs(slot->msg, logfile);
+        atomic_store_explicit(&slot->seq, logDequeuePos + LOG_RING_SLOTS,
+                              memory_order_release);
+        logDequeuePos++;
+        written++;
+    }
+    unsigned long dropped = atomic_exchange(&logDropped, 0);
+    if (dropped > 0)
+        fprintf(logfile, "log: dropped %lu messages\n", dropped);
+    if (written > 0 || dropped > 0)
+        fflush(logfile);
+    return written;
+}
+
+static void *log_thread_main(void *arg){
+    (void)arg;
+    struct timespec idle = {0, 1000000};
+    while (atomic_load(&logRunning)) {
+        if (drain_log() == 0)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+// Start the log thread. This has to happen after FUSE has daemonised, as
+// threads do not survive the fork.
+void start_log_thread(){
+    if (myfs_log_level == MYFS_LOG_OFF || atomic_load(&logRunning))
+        return;
+    atomic_store(&logRunning, true);
+    if (pthread_create(&logThread, NULL, log_thread_main, NULL) != 0)
+        atomic_store(&logRunning, false);
+}
+
+// Stop the log thread and write out whatever is still queued.
+void stop_log(){
+    if (atomic_exchange(&logRunning, false))
+        pthread_join(logThread, NULL);
+    drain_log();
 }
 
 // Simple error handler which cleans up and quits
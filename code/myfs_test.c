@@ -0,0 +1,712 @@
+// Tests of the myfs handlers, driven in-process through driver.h: no FUSE
+// mount needed. The store lives in a fresh temporary directory, which is
+// removed afterwards.
+//
+// Usage: myfs_test, exits non-zero if a test fails.
+
+#define main myfs_main
+#include "myfs.c"
+#undef main
+
+#include "driver.h"
+
+// Create an empty file 'name' in 'dir' and return its inode.
+static fuse_ino_t createFile(fuse_ino_t dir, const char *name) {
+  struct fuse_file_info fi;
+  fuse_ino_t ino = doCreate(dir, name, &fi);
+  doRelease(ino, &fi);
+  doForget(ino, 1);
+  return ino;
+}
+
+// Create 'count' empty files named <prefix><number> in 'dir'.
+static void createFiles(fuse_ino_t dir, const char *prefix, int first,
+                        int count) {
+  for (int i = first; i < first + count; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s%d", prefix, i);
+    createFile(dir, name);
+  }
+}
+
+// Listing a directory must cost time linear in its size: every readdir
+// carries on where the last one stopped and fetches only the segments of
+// entries it lists from, so a page of entries costs the same wherever it is
+// in a directory of 10000 entries as in one of 1000. Counted in dirent bytes
+// fetched: a readdir that walked or copied the entries from the first one
+// fetched the whole directory.
+#define LINEAR_SMALL 1000
+#define LINEAR_LARGE 10000
+// The segment a readdir carries on in and those it lists from
+#define LINEAR_PAGE_BYTES (3 * DIRENT_SEGMENT_SIZE)
+
+// List the directory 'dir' of 'entries' entries. Returns the most dirent
+// bytes a readdir of one page fetched, or -1 if an entry went missing. Each
+// entry listed costs the fetch of its FCB, a bare myfcb for an empty file,
+// and the directory's own FCB may be fetched once per call.
+static long readdirPageBytes(fuse_ino_t dir, size_t entries) {
+  struct opStats *stats = &opStats[OP_READDIR];
+  struct fuse_file_info fi;
+  doOpendir(dir, &fi);
+  off_t off = 0;
+  size_t listed = 0;
+  long most = 0;
+  for (;;) {
+    unsigned long long bytes = stats->fetchBytes;
+    size_t n = doReaddirPage(dir, &fi, &off, NULL, NULL);
+    if (n == 0)
+      break;
+    long dirents = (long)(stats->fetchBytes - bytes) -
+                   (long)((n + 1) * sizeof(myfcb));
+    if (dirents > most)
+      most = dirents;
+    listed += n;
+  }
+  doReleasedir(dir, &fi);
+  if (listed != entries + 2) {
+    fprintf(stderr, "readdir linear: listed %zu of %zu entries\n", listed,
+            entries + 2);
+    return -1;
+  }
+  return most;
+}
+
+static int testReaddirLinear(void) {
+  fuse_ino_t small = doMkdir(FUSE_ROOT_ID, "small");
+  createFiles(small, "f", 0, LINEAR_SMALL);
+  fuse_ino_t large = doMkdir(FUSE_ROOT_ID, "large");
+  createFiles(large, "f", 0, LINEAR_LARGE);
+
+  long smallBytes = readdirPageBytes(small, LINEAR_SMALL);
+  long largeBytes = readdirPageBytes(large, LINEAR_LARGE);
+  if (smallBytes < 0 || largeBytes < 0)
+    return -1;
+  printf("readdir linear: a page fetches up to %ld dirent bytes with %d "
+         "entries, %ld with %d\n",
+         smallBytes, LINEAR_SMALL, largeBytes, LINEAR_LARGE);
+  if (smallBytes > LINEAR_PAGE_BYTES || largeBytes > LINEAR_PAGE_BYTES) {
+    fprintf(stderr, "readdir linear: a page fetches more than %d bytes\n",
+            LINEAR_PAGE_BYTES);
+    return -1;
+  }
+  return 0;
+}
+
+// How often each name was listed.
+#define CHANGES_ENTRIES 300
+
+struct listed {
+  int original[CHANGES_ENTRIES];
+  int added[CHANGES_ENTRIES];
+  int dots;
+};
+
+static void countListed(const char *name, void *arg) {
+  struct listed *l = arg;
+  int i = atoi(name + 1);
+  if (name[0] == 'e')
+    l->original[i]++;
+  else if (name[0] == 'n')
+    l->added[i]++;
+  else
+    l->dots++;
+}
+
+// A directory changed between two readdirs of one handle: every entry there
+// throughout is listed exactly once, removed entries not yet listed are not
+// listed, and entries added since are listed after the rest. Reading from
+// offset 0 again starts over.
+static int testReaddirChanges(void) {
+  fuse_ino_t dir = doMkdir(FUSE_ROOT_ID, "changes");
+  createFiles(dir, "e", 0, CHANGES_ENTRIES);
+
+  struct listed l;
+  memset(&l, 0, sizeof(l));
+  struct fuse_file_info fi;
+  doOpendir(dir, &fi);
+  off_t off = 0;
+  doReaddirPage(dir, &fi, &off, countListed, &l);
+  int removed = 0;
+  for (int i = 0; i < CHANGES_ENTRIES; i += 2) {
+    if (l.original[i] == 0) {
+      char name[32];
+      snprintf(name, sizeof(name), "e%d", i);
+      doUnlink(dir, name);
+      removed++;
+    }
+  }
+  createFiles(dir, "n", 0, 50);
+  while (doReaddirPage(dir, &fi, &off, countListed, &l) > 0)
+    ;
+
+  int rc = 0;
+  if (removed == 0 || l.dots != 2)
+    rc = -1;
+  for (int i = 0; i < CHANGES_ENTRIES; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "e%d", i);
+    int want = i % 2 == 1 || l.original[i] > 0 ? 1 : 0;
+    if (l.original[i] != want) {
+      fprintf(stderr, "readdir changes: %s listed %d times\n", name,
+              l.original[i]);
+      rc = -1;
+    }
+    if (i < 50 && l.added[i] != 1) {
+      fprintf(stderr, "readdir changes: n%d listed %d times\n", i,
+              l.added[i]);
+      rc = -1;
+    }
+  }
+
+  memset(&l, 0, sizeof(l));
+  off = 0;
+  while (doReaddirPage(dir, &fi, &off, countListed, &l) > 0)
+    ;
+  doReleasedir(dir, &fi);
+  int total = l.dots;
+  for (int i = 0; i < CHANGES_ENTRIES; i++)
+    total += l.original[i] + l.added[i];
+  if (total != 2 + CHANGES_ENTRIES - removed + 50) {
+    fprintf(stderr, "readdir changes: relisting found %d entries\n", total);
+    rc = -1;
+  }
+  return rc;
+}
+
+static void countNames(const char *name, void *arg) {
+  (void)name;
+  (*(int *)arg)++;
+}
+
+// An entry whose FCB cannot be read is still listed, and does not stop the
+// rest of the directory from being listed.
+static int testReaddirUnreadable(void) {
+  fuse_ino_t dir = doMkdir(FUSE_ROOT_ID, "unreadable");
+  createFiles(dir, "a", 0, 10);
+  struct fuse_file_info fi;
+  fuse_ino_t ino = doCreate(dir, "lost", &fi);
+  doRelease(ino, &fi);
+  uuid_t uuid;
+  if (itableLookup(ino, uuid, NULL) < 0)
+    return -1;
+  txnEnter();
+  int rc = kvDelete(uuid, KEY_SIZE);
+  txnExit();
+  doForget(ino, 1);
+  if (rc != UNQLITE_OK)
+    return -1;
+  createFiles(dir, "b", 0, 10);
+
+  int listed = 0;
+  doOpendir(dir, &fi);
+  off_t off = 0;
+  while (doReaddirPage(dir, &fi, &off, countNames, &listed) > 0)
+    ;
+  doReleasedir(dir, &fi);
+  if (listed != 2 + 21) {
+    fprintf(stderr, "readdir unreadable: listed %d of %d entries\n", listed,
+            2 + 21);
+    return -1;
+  }
+  return 0;
+}
+
+// The inode 'name' in 'dir' refers to, or 0 if there is no such entry. The
+// lookup reference is dropped again.
+static fuse_ino_t entryIno(fuse_ino_t dir, const char *name) {
+  fuse_ino_t ino;
+  if (tryLookup(dir, name, &ino) != 0)
+    return 0;
+  doForget(ino, 1);
+  return ino;
+}
+
+// Check that 'name' in 'dir' refers to 'want', 0 for no entry.
+static int expectEntry(const char *test, fuse_ino_t dir, const char *name,
+                       fuse_ino_t want) {
+  fuse_ino_t ino = entryIno(dir, name);
+  if (ino != want) {
+    fprintf(stderr, "%s: %s is inode %lu, expected %lu\n", test, name,
+            (unsigned long)ino, (unsigned long)want);
+    return -1;
+  }
+  return 0;
+}
+
+// Check that the directory 'dir' has 'entries' entries besides "." and ".."
+// and 'nlink' links.
+static int expectDir(const char *test, fuse_ino_t dir, size_t entries,
+                     nlink_t nlink) {
+  size_t listed = doReaddir(dir);
+  struct stat st = doGetattr(dir);
+  if (listed != entries + 2 || st.st_nlink != nlink) {
+    fprintf(stderr, "%s: directory lists %zu entries with %lu links, "
+            "expected %zu with %lu\n", test, listed,
+            (unsigned long)st.st_nlink, entries + 2, (unsigned long)nlink);
+    return -1;
+  }
+  return 0;
+}
+
+// Renaming a file onto another replaces it: the name refers to the renamed
+// file and the replaced one is gone.
+static int testRenameReplaceFile(void) {
+  const char *test = "rename replace file";
+  fuse_ino_t dir = doMkdir(FUSE_ROOT_ID, "replacefile");
+  fuse_ino_t from = createFile(dir, "from");
+  createFile(dir, "to");
+  int err = tryRename(dir, "from", dir, "to");
+  if (err != 0) {
+    fprintf(stderr, "%s: %s\n", test, strerror(err));
+    return -1;
+  }
+  if (expectEntry(test, dir, "to", from) != 0 ||
+      expectEntry(test, dir, "from", 0) != 0)
+    return -1;
+  return expectDir(test, dir, 1, 2);
+}
+
+// Renaming a directory onto an empty one replaces it, and the parent loses
+// the link from the replaced directory's "..".
+static int testRenameReplaceDir(void) {
+  const char *test = "rename replace dir";
+  fuse_ino_t dir = doMkdir(FUSE_ROOT_ID, "replacedir");
+  fuse_ino_t from = doMkdir(dir, "from");
+  fuse_ino_t child = createFile(from, "child");
+  doMkdir(dir, "to");
+  if (expectDir(test, dir, 2, 4) != 0)
+    return -1;
+  int err = tryRename(dir, "from", dir, "to");
+  if (err != 0) {
+    fprintf(stderr, "%s: %s\n", test, strerror(err));
+    return -1;
+  }
+  if (expectEntry(test, dir, "to", from) != 0 ||
+      expectEntry(test, dir, "from", 0) != 0 ||
+      expectEntry(test, from, "child", child) != 0)
+    return -1;
+  return expectDir(test, dir, 1, 3);
+}
+
+// A rename fails, changing nothing, onto a directory that is not empty and
+// from a name that does not exist.
+static int testRenameErrors(void) {
+  const char *test = "rename errors";
+  fuse_ino_t dir = doMkdir(FUSE_ROOT_ID, "renameerrors");
+  fuse_ino_t from = doMkdir(dir, "from");
+  fuse_ino_t to = doMkdir(dir, "to");
+  fuse_ino_t child = createFile(to, "child");
+  int rc = 0;
+  int err = tryRename(dir, "from", dir, "to");
+  if (err != ENOTEMPTY) {
+    fprintf(stderr, "%s: onto a full directory: %s\n", test, strerror(err));
+    rc = -1;
+  }
+  err = tryRename(dir, "missing", dir, "other");
+  if (err != ENOENT) {
+    fprintf(stderr, "%s: a missing name: %s\n", test, strerror(err));
+    rc = -1;
+  }
+  if (expectEntry(test, dir, "from", from) != 0 ||
+      expectEntry(test, dir, "to", to) != 0 ||
+      expectEntry(test, to, "child", child) != 0 ||
+      expectEntry(test, dir, "other", 0) != 0 ||
+      expectDir(test, dir, 2, 4) != 0)
+    rc = -1;
+  return rc;
+}
+
+// Moving a directory to another parent takes its contents along, and moves
+// the link from its ".." from the old parent to the new one.
+static int testRenameAcrossDirs(void) {
+  const char *test = "rename across dirs";
+  fuse_ino_t top = doMkdir(FUSE_ROOT_ID, "across");
+  fuse_ino_t a = doMkdir(top, "a");
+  fuse_ino_t b = doMkdir(top, "b");
+  fuse_ino_t moved = doMkdir(a, "moved");
+  fuse_ino_t sub = doMkdir(moved, "sub");
+  fuse_ino_t file = createFile(moved, "file");
+  doMkdir(b, "stays");
+  if (expectDir(test, a, 1, 3) != 0 || expectDir(test, b, 1, 3) != 0)
+    return -1;
+  int err = tryRename(a, "moved", b, "moved");
+  if (err != 0) {
+    fprintf(stderr, "%s: %s\n", test, strerror(err));
+    return -1;
+  }
+  if (expectEntry(test, a, "moved", 0) != 0 ||
+      expectEntry(test, b, "moved", moved) != 0 ||
+      expectEntry(test, moved, "sub", sub) != 0 ||
+      expectEntry(test, moved, "file", file) != 0 ||
+      expectDir(test, a, 0, 2) != 0 || expectDir(test, b, 2, 4) != 0 ||
+      expectDir(test, moved, 2, 3) != 0)
+    return -1;
+  return 0;
+}
+
+// Renaming a name onto itself succeeds and changes nothing.
+static int testRenameItself(void) {
+  const char *test = "rename to itself";
+  fuse_ino_t dir = doMkdir(FUSE_ROOT_ID, "itself");
+  fuse_ino_t file = createFile(dir, "file");
+  fuse_ino_t sub = doMkdir(dir, "sub");
+  int err = tryRename(dir, "file", dir, "file");
+  if (err == 0)
+    err = tryRename(dir, "sub", dir, "sub");
+  if (err != 0) {
+    fprintf(stderr, "%s: %s\n", test, strerror(err));
+    return -1;
+  }
+  if (expectEntry(test, dir, "file", file) != 0 ||
+      expectEntry(test, dir, "sub", sub) != 0)
+    return -1;
+  return expectDir(test, dir, 2, 3);
+}
+
+// Fill 'buf' with bytes that depend on 'seed', so stale data is told apart.
+static void fillPattern(char *buf, size_t size, unsigned seed) {
+  for (size_t i = 0; i < size; i++)
+    buf[i] = (char)(seed * 7 + i + i / 251);
+}
+
+// Read 'size' bytes at 'off' of the open file 'ino' and check that exactly
+// those at 'want' come back.
+static int expectData(const char *test, fuse_ino_t ino,
+                      struct fuse_file_info *fi, const char *want, size_t size,
+                      off_t off) {
+  static char got[4 * CHUNK_SIZE];
+  size_t n = doRead(ino, fi, got, sizeof(got), off);
+  if (n != size || memcmp(got, want, size) != 0) {
+    fprintf(stderr, "%s: read %zu bytes at %lld, expected %zu%s\n", test, n,
+            (long long)off, size, n == size ? " but they differ" : "");
+    return -1;
+  }
+  return 0;
+}
+
+// Check that the file 'ino' is 'size' bytes long.
+static int expectSize(const char *test, fuse_ino_t ino, off_t size) {
+  struct stat st = doGetattr(ino);
+  if (st.st_size != size) {
+    fprintf(stderr, "%s: size %lld, expected %lld\n", test,
+            (long long)st.st_size, (long long)size);
+    return -1;
+  }
+  return 0;
+}
+
+// Stores charged to the operation 'op' so far.
+static unsigned long long storesOf(int op) { return opStats[op].stores; }
+
+// Small writes that continue one another stay in the write-back buffer, where
+// reads and stat see them, and reach the store together on flush.
+#define COALESCE_WRITES 60
+#define COALESCE_SIZE 1000
+
+static int testWritebackCoalesce(void) {
+  const char *test = "writeback coalesce";
+  static char data[COALESCE_WRITES * COALESCE_SIZE];
+  fillPattern(data, sizeof(data), 1);
+  struct fuse_file_info fi;
+  fuse_ino_t ino = doCreate(FUSE_ROOT_ID, "coalesce", &fi);
+  unsigned long long writes = storesOf(OP_WRITE);
+  for (int i = 0; i < COALESCE_WRITES; i++)
+    doWrite(ino, &fi, data + i * COALESCE_SIZE, COALESCE_SIZE,
+            i * COALESCE_SIZE);
+  int rc = 0;
+  if (storesOf(OP_WRITE) != writes) {
+    fprintf(stderr, "%s: buffered writes stored %llu records\n", test,
+            storesOf(OP_WRITE) - writes);
+    rc = -1;
+  }
+  // Not flushed yet, so both come from the buffer
+  if (expectSize(test, ino, sizeof(data)) != 0 ||
+      expectData(test, ino, &fi, data, sizeof(data), 0) != 0)
+    rc = -1;
+  // One chunk and the FCB
+  unsigned long long flushes = storesOf(OP_FLUSH);
+  doRelease(ino, &fi);
+  if (storesOf(OP_FLUSH) - flushes != 2) {
+    fprintf(stderr, "%s: flush stored %llu records, expected 2\n", test,
+            storesOf(OP_FLUSH) - flushes);
+    rc = -1;
+  }
+  doOpen(ino, &fi);
+  if (expectData(test, ino, &fi, data, sizeof(data), 0) != 0)
+    rc = -1;
+  doRelease(ino, &fi);
+  doForget(ino, 1);
+  return rc;
+}
+
+// Truncating a file with a write-back buffer writes the buffer out first, so
+// the buffered bytes past the new end are gone and growing the file again
+// reads back zeros there.
+static int testWritebackTruncate(void) {
+  const char *test = "writeback truncate";
+  static char data[3 * INLINE_DATA_MAX];
+  fillPattern(data, sizeof(data), 2);
+  struct fuse_file_info fi;
+  fuse_ino_t ino = doCreate(FUSE_ROOT_ID, "wbtruncate", &fi);
+  doWrite(ino, &fi, data, sizeof(data), 0);
+  struct stat st = doTruncate(ino, INLINE_DATA_MAX + 100);
+  int rc = 0;
+  if (st.st_size != INLINE_DATA_MAX + 100) {
+    fprintf(stderr, "%s: truncate replied size %lld\n", test,
+            (long long)st.st_size);
+    rc = -1;
+  }
+  if (expectSize(test, ino, INLINE_DATA_MAX + 100) != 0 ||
+      expectData(test, ino, &fi, data, INLINE_DATA_MAX + 100, 0) != 0)
+    rc = -1;
+  // Grow it again with a buffered write past the end
+  char tail[10];
+  fillPattern(tail, sizeof(tail), 3);
+  doWrite(ino, &fi, tail, sizeof(tail), sizeof(data));
+  memset(data + INLINE_DATA_MAX + 100, 0,
+         sizeof(data) - INLINE_DATA_MAX - 100);
+  static char want[sizeof(data) + sizeof(tail)];
+  memcpy(want, data, sizeof(data));
+  memcpy(want + sizeof(data), tail, sizeof(tail));
+  if (expectData(test, ino, &fi, want, sizeof(want), 0) != 0)
+    rc = -1;
+  doRelease(ino, &fi);
+  doOpen(ino, &fi);
+  if (expectData(test, ino, &fi, want, sizeof(want), 0) != 0)
+    rc = -1;
+  doRelease(ino, &fi);
+  doForget(ino, 1);
+  return rc;
+}
+
+// Once the buffers of all open files hold WRITEBACK_LIMIT bytes, a write that
+// would need another buffer goes straight to the store.
+#define LIMIT_FILES (WRITEBACK_LIMIT / WRITEBACK_MAX)
+
+static int testWritebackLimit(void) {
+  const char *test = "writeback limit";
+  static fuse_ino_t inos[LIMIT_FILES + 1];
+  static struct fuse_file_info fis[LIMIT_FILES + 1];
+  char data[100];
+  fuse_ino_t dir = doMkdir(FUSE_ROOT_ID, "wblimit");
+  unsigned long long writes = storesOf(OP_WRITE);
+  int rc = 0;
+  for (int i = 0; i <= LIMIT_FILES; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "f%d", i);
+    inos[i] = doCreate(dir, name, &fis[i]);
+    fillPattern(data, sizeof(data), i);
+    if (i == LIMIT_FILES) {
+      if (atomic_load(&writebackBytes) != WRITEBACK_LIMIT) {
+        fprintf(stderr, "%s: buffers hold %zu bytes, expected %d\n", test,
+                atomic_load(&writebackBytes), WRITEBACK_LIMIT);
+        rc = -1;
+      }
+      if (storesOf(OP_WRITE) != writes) {
+        fprintf(stderr, "%s: buffered writes stored %llu records\n", test,
+                storesOf(OP_WRITE) - writes);
+        rc = -1;
+      }
+    }
+    doWrite(inos[i], &fis[i], data, sizeof(data), 0);
+  }
+  if (storesOf(OP_WRITE) == writes) {
+    fprintf(stderr, "%s: a write past the limit was buffered\n", test);
+    rc = -1;
+  }
+  for (int i = 0; i <= LIMIT_FILES; i++) {
+    fillPattern(data, sizeof(data), i);
+    if (expectData(test, inos[i], &fis[i], data, sizeof(data), 0) != 0)
+      rc = -1;
+    doRelease(inos[i], &fis[i]);
+    doForget(inos[i], 1);
+  }
+  if (atomic_load(&writebackBytes) != 0) {
+    fprintf(stderr, "%s: %zu bytes still buffered after release\n", test,
+            atomic_load(&writebackBytes));
+    rc = -1;
+  }
+  return rc;
+}
+
+// Length of the record under 'key', or -1 if there is none.
+static long recordLength(const void *key, int keyLen) {
+  unqlite_int64 len;
+  return kvFetch(key, keyLen, NULL, &len) == UNQLITE_OK ? (long)len : -1;
+}
+
+// Check where the data of the file 'ino' lives: 'inlineLen' bytes in its FCB
+// record, and a chunk 0 of 'chunkLen' bytes, -1 for none.
+static int expectLayout(const char *test, fuse_ino_t ino, long inlineLen,
+                        long chunkLen) {
+  uuid_t uuid;
+  myfcb fcb;
+  if (itableLookup(ino, uuid, &fcb) < 0)
+    return -1;
+  unsigned char key[CHUNK_KEY_SIZE];
+  chunkKey(fcb.file_data_id, 0, key);
+  long record = recordLength(uuid, KEY_SIZE) - (long)sizeof(myfcb);
+  long chunk = recordLength(key, CHUNK_KEY_SIZE);
+  if (record != inlineLen || chunk != chunkLen) {
+    fprintf(stderr, "%s: %ld bytes inline and a chunk of %ld, expected %ld "
+            "and %ld\n", test, record, chunk, inlineLen, chunkLen);
+    return -1;
+  }
+  return 0;
+}
+
+// A small file keeps its data in its FCB record, moves it into chunks when
+// it grows past INLINE_DATA_MAX and back into the record when it is
+// truncated below that again, reading back the same data throughout.
+static int testInlineSpill(void) {
+  const char *test = "inline spill";
+  static char data[INLINE_DATA_MAX + 1000];
+  fillPattern(data, sizeof(data), 4);
+  struct fuse_file_info fi;
+  fuse_ino_t ino = doCreate(FUSE_ROOT_ID, "spill", &fi);
+  doWrite(ino, &fi, data, INLINE_DATA_MAX, 0);
+  doRelease(ino, &fi);
+  int rc = expectLayout(test, ino, INLINE_DATA_MAX, -1);
+
+  doOpen(ino, &fi);
+  doWrite(ino, &fi, data + INLINE_DATA_MAX, sizeof(data) - INLINE_DATA_MAX,
+          INLINE_DATA_MAX);
+  doRelease(ino, &fi);
+  if (expectLayout(test, ino, 0, sizeof(data)) != 0)
+    rc = -1;
+  doOpen(ino, &fi);
+  if (expectData(test, ino, &fi, data, sizeof(data), 0) != 0)
+    rc = -1;
+
+  doTruncate(ino, 1000);
+  if (expectLayout(test, ino, 1000, -1) != 0 ||
+      expectData(test, ino, &fi, data, 1000, 0) != 0)
+    rc = -1;
+  doRelease(ino, &fi);
+  doForget(ino, 1);
+  return rc;
+}
+
+// Length of chunk 'index' of the file 'ino', or -1 if it is not stored.
+static long chunkLength(fuse_ino_t ino, uint64_t index) {
+  uuid_t uuid;
+  myfcb fcb;
+  if (itableLookup(ino, uuid, &fcb) < 0)
+    return -1;
+  unsigned char key[CHUNK_KEY_SIZE];
+  chunkKey(fcb.file_data_id, index, key);
+  return recordLength(key, CHUNK_KEY_SIZE);
+}
+
+// Writing past the end of a file leaves a hole that is not stored and reads
+// back as zeros.
+static int testChunkHole(void) {
+  const char *test = "chunk hole";
+  static char want[3 * CHUNK_SIZE + 20];
+  memset(want, 0, sizeof(want));
+  fillPattern(want + 3 * CHUNK_SIZE + 10, 10, 5);
+  struct fuse_file_info fi;
+  fuse_ino_t ino = doCreate(FUSE_ROOT_ID, "hole", &fi);
+  doWrite(ino, &fi, want + 3 * CHUNK_SIZE + 10, 10, 3 * CHUNK_SIZE + 10);
+  doRelease(ino, &fi);
+  int rc = 0;
+  for (uint64_t i = 0; i < 4; i++) {
+    long len = chunkLength(ino, i);
+    if (len != (i < 3 ? -1 : 20)) {
+      fprintf(stderr, "%s: chunk %llu holds %ld bytes\n", test,
+              (unsigned long long)i, len);
+      rc = -1;
+    }
+  }
+  doOpen(ino, &fi);
+  if (expectSize(test, ino, sizeof(want)) != 0 ||
+      expectData(test, ino, &fi, want, sizeof(want), 0) != 0 ||
+      expectData(test, ino, &fi, want + CHUNK_SIZE - 5, sizeof(want) -
+                 CHUNK_SIZE + 5, CHUNK_SIZE - 5) != 0)
+    rc = -1;
+  doRelease(ino, &fi);
+  doForget(ino, 1);
+  return rc;
+}
+
+// Truncating a file in the middle of a chunk trims that chunk and deletes
+// those past it, so growing the file again reads back zeros rather than the
+// old data.
+static int testChunkTruncate(void) {
+  const char *test = "chunk truncate";
+  static char data[2 * CHUNK_SIZE + CHUNK_SIZE / 2];
+  const off_t cut = CHUNK_SIZE + CHUNK_SIZE / 2 + 7;
+  fillPattern(data, sizeof(data), 6);
+  struct fuse_file_info fi;
+  fuse_ino_t ino = doCreate(FUSE_ROOT_ID, "midchunk", &fi);
+  doWrite(ino, &fi, data, sizeof(data), 0);
+  doRelease(ino, &fi);
+
+  doTruncate(ino, cut);
+  int rc = 0;
+  if (chunkLength(ino, 1) != cut - CHUNK_SIZE || chunkLength(ino, 2) != -1) {
+    fprintf(stderr, "%s: chunks of %ld and %ld bytes left\n", test,
+            chunkLength(ino, 1), chunkLength(ino, 2));
+    rc = -1;
+  }
+  doOpen(ino, &fi);
+  if (expectData(test, ino, &fi, data, cut, 0) != 0)
+    rc = -1;
+  doTruncate(ino, sizeof(data));
+  memset(data + cut, 0, sizeof(data) - cut);
+  if (expectSize(test, ino, sizeof(data)) != 0 ||
+      expectData(test, ino, &fi, data, sizeof(data), 0) != 0)
+    rc = -1;
+  doRelease(ino, &fi);
+  doForget(ino, 1);
+  return rc;
+}
+
+static const struct {
+  const char *name;
+  int (*run)(void);
+} tests[] = {
+    {"readdir linear", testReaddirLinear},
+    {"readdir changes", testReaddirChanges},
+    {"readdir unreadable", testReaddirUnreadable},
+    {"rename replace file", testRenameReplaceFile},
+    {"rename replace dir", testRenameReplaceDir},
+    {"rename errors", testRenameErrors},
+    {"rename across dirs", testRenameAcrossDirs},
+    {"rename to itself", testRenameItself},
+    {"writeback coalesce", testWritebackCoalesce},
+    {"writeback truncate", testWritebackTruncate},
+    {"writeback limit", testWritebackLimit},
+    {"inline spill", testInlineSpill},
+    {"chunk hole", testChunkHole},
+    {"chunk truncate", testChunkTruncate},
+};
+
+int main(void) {
+  char dir[] = "/tmp/myfs-test.XXXXXX";
+  if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+    perror("myfs_test");
+    return 1;
+  }
+  myfs_log_level = MYFS_LOG_OFF;
+  init_log_file();
+  init_fs();
+  struct fuse_conn_info conn;
+  memset(&conn, 0, sizeof(conn));
+  myfs_oper.init(NULL, &conn);
+
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+    int rc = tests[i].run();
+    printf("%-24s %s\n", tests[i].name, rc == 0 ? "ok" : "FAILED");
+    if (rc != 0)
+      failed++;
+  }
+
+  shutdown_fs();
+  unlink(DATABASE_NAME);
+  unlink("myfs.log");
+  if (chdir("/") == 0)
+    rmdir(dir);
+  return failed != 0;
+}
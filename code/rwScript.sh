@@ -1,3 +0,0 @@
-v=${f}
-echo "hello" > $v"hello.txt"
-cat $v"hello.txt"
@@ -1,6 +0,0 @@
-ls -la /cs/scratch/jk218/mnt
-stat /cs/scratch/jk218/mnt
-echo “hello!” > /cs/scratch/jk218/mnt/afile.txt
-cat /cs/scratch/jk218/mnt/afile.txt
-ls -la /cs/scratch/jk218/mnt/afile.txt
-stat /cs/scratch/jk218/mnt/afile.txt
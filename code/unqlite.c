@@ -49785,8 +49785,8 @@ static int lhPageDefragment(lhpage *pPage)
 	lhcell *pCell;
 	/* Get a temporary page from the pager. This opertaion never fail */
 	zTmp = pEngine->pIo->xTmpPage(pEngine->pIo->pHandle);
-	/* Move the target cells to the begining */
-	pCell = pPage->pList;
+	/* Move the target cells to the begining (cells of slave pages are kept on the master list) */
+	pCell = pPage->pMaster->pList;
 	/* Write the slave page number */
 	SyBigEndianPack64(&zTmp[2/*Offset of the first cell */+2/*Offset of the first free block */],pPage->sHdr.iSlave);
 	zPtr = &zTmp[L_HASH_PAGE_HDR_SZ]; /* Offset to start writing from */
@@ -49881,9 +49881,21 @@ static int lhAllocateSpace(lhpage *pPage,sxu64 nAmount,sxu16 *pOfft)
 		/* Big chunk need an overflow page for its data */
 		return UNQLITE_FULL;
 	}
+	/* Acquire writer lock on this page (defragmentation rewrites it) */
+	rc = pPage->pHash->pIo->xWrite(pPage->pRaw);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	nByte = (sxu16)nAmount;
+	if( pPage->sHdr.iFree < 1 ){
+		/* Free space is only made of discarded leftovers, no block is linked */
+		rc = lhPageDefragment(pPage);
+		if( rc != UNQLITE_OK || pPage->sHdr.iFree < 1 || pPage->nFree < nByte ){
+			return UNQLITE_FULL;
+		}
+	}
 	zPtr = &pPage->pRaw->zData[pPage->sHdr.iFree];
 	zEnd = &pPage->pRaw->zData[pPage->pHash->iPageSize];
-	nByte = (sxu16)nAmount;
 	zPrev = 0;
 	iBlksz = 0; /* cc warning */
 	/* Perform the lookup */
@@ -49917,11 +49929,6 @@ static int lhAllocateSpace(lhpage *pPage,sxu64 nAmount,sxu16 *pOfft)
 		/* Point to the next free block */
 		zPtr = &pPage->pRaw->zData[iNext];
 	}
-	/* Acquire writer lock on this page */
-	rc = pPage->pHash->pIo->xWrite(pPage->pRaw);
-	if( rc != UNQLITE_OK ){
-		return rc;
-	}
 	/* Save block offset */
 	*pOfft = (sxu16)(zPtr - pPage->pRaw->zData);
 	/* Fix pointers */
@@ -50544,7 +50551,8 @@ static int lhRecordAppend(
 			nAvail = L_HASH_OVERFLOW_SIZE(pCell->pPage->pHash->iPageSize);
 			pOvfl = pNew;
 		}
-		if( (sxu64)nAvail > nDatalen ){
+		if( (sxu64)nAvail >= nDatalen ){
+			/* The data may end right at the end of this page, the copy below then chains a new one */
 			zRaw += nDatalen;
 			break;
 		}else{
@@ -57055,6 +57063,15 @@ static int pager_write_hot_dirty_pages(Pager *pPager,Page *pDirty)
 		}
 		/* Point to the next page */
 		pNext = pDirty->pPrevHot; /* Not a bug: Reverse link */
+		if( pDirty->nRef > 0 ){
+			/* Referenced again since it went hot: the caller may still be
+			 * changing it without another xWrite(), so keep it dirty for the
+			 * final commit rather than write it and forget the rest.
+			 */
+			pDirty->flags &= ~PAGE_HOT_DIRTY;
+			pDirty = pNext;
+			continue;
+		}
 		if( (pDirty->flags & PAGE_DONT_WRITE) == 0 ){
 			rc = unqliteOsWrite(pPager->pfd,pDirty->zData,pPager->iPageSize,pDirty->pgno * pPager->iPageSize);
 			if( rc != UNQLITE_OK ){
@@ -0,0 +1,249 @@
+// Regression tests for the fixes made to the bundled UnQLite.
+//
+// Each test drives the public key/value API into one bug that was fixed in
+// unqlite.c, and fails if the fix is reverted. Every test gets a fresh
+// database in a temporary directory, which is removed afterwards.
+//
+// Usage: unqlite_test, exits non-zero if a test fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "unqlite.h"
+
+#define TEST_DATABASE "test.db"
+
+// Fills buf with bytes that depend on seed, so stale data is told apart.
+static void fillPattern(char *buf, size_t size, unsigned seed) {
+  for (size_t i = 0; i < size; i++)
+    buf[i] = (char)(seed * 7 + i + i / 251);
+}
+
+// xorshift32: the same pseudo-random sequence on every libc.
+static unsigned xorshift(unsigned *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+// Fetches key and compares it with the size bytes at want.
+static int checkRecord(unqlite *db, const char *key, const char *want,
+                       size_t size, const char *test) {
+  static char got[64 << 10];
+  unqlite_int64 n = sizeof(got);
+  int rc = unqlite_kv_fetch(db, key, -1, got, &n);
+  if (rc != UNQLITE_OK || (size_t)n != size) {
+    fprintf(stderr, "%s: record %s: rc %d, %lld bytes, expected %zu\n", test,
+            key, rc, (long long)n, size);
+    return -1;
+  }
+  if (memcmp(got, want, size) != 0) {
+    fprintf(stderr, "%s: record %s: wrong data\n", test, key);
+    return -1;
+  }
+  return 0;
+}
+
+// pager_write_hot_dirty_pages released a page it flushed even when the page
+// had been referenced again since it went hot. Later changes to that page
+// were lost and the freed page was reused, so one long transaction that
+// keeps rewriting large records read back corrupt data.
+static int testHotPages(unqlite *db) {
+  static char buf[32 << 10];
+  for (unsigned i = 0; i < 5000; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "rec%u", (i * 37) % 64);
+    size_t size = (16 << 10) + (i * 7919) % (16 << 10);
+    fillPattern(buf, size, i);
+    if (unqlite_kv_store(db, key, -1, buf, size) != UNQLITE_OK) {
+      fprintf(stderr, "hot pages: store %u failed\n", i);
+      return -1;
+    }
+    if (checkRecord(db, key, buf, size, "hot pages") != 0)
+      return -1;
+  }
+  return 0;
+}
+
+// lhPageDefragment walked the page's own cell list, which is empty for
+// slave pages, so defragmenting a slave page dropped its live cells. Random
+// stores, deletes and commits of small records fill buckets with slave
+// pages and fragment them; fetches are checked against a model.
+#define MODEL_KEYS 3000
+#define MODEL_MAX_SIZE 600
+
+// Checks that record k holds the given version, or is absent if size is 0.
+static int checkModel(unqlite *db, unsigned k, unsigned version,
+                      size_t size) {
+  static char want[MODEL_MAX_SIZE];
+  char key[16];
+  snprintf(key, sizeof(key), "k%u", k);
+  if (size == 0) {
+    unqlite_int64 n = 0;
+    if (unqlite_kv_fetch(db, key, -1, NULL, &n) != UNQLITE_NOTFOUND) {
+      fprintf(stderr, "slave defragment: deleted record %s found\n", key);
+      return -1;
+    }
+    return 0;
+  }
+  fillPattern(want, size, k * 31 + version);
+  return checkRecord(db, key, want, size, "slave defragment");
+}
+
+static int testSlaveDefragment(unqlite *db) {
+  static unsigned version[MODEL_KEYS];
+  static size_t sizes[MODEL_KEYS];
+  static char buf[MODEL_MAX_SIZE];
+  memset(version, 0, sizeof(version));
+  memset(sizes, 0, sizeof(sizes));
+  unsigned rng = 2463534242u;
+  for (unsigned i = 0; i < 40000; i++) {
+    unsigned k = xorshift(&rng) % MODEL_KEYS, op = xorshift(&rng) % 10;
+    char key[16];
+    snprintf(key, sizeof(key), "k%u", k);
+    if (op < 6) {
+      sizes[k] = 1 + xorshift(&rng) % MODEL_MAX_SIZE;
+      fillPattern(buf, sizes[k], k * 31 + ++version[k]);
+      if (unqlite_kv_store(db, key, -1, buf, sizes[k]) != UNQLITE_OK) {
+        fprintf(stderr, "slave defragment: store %u failed\n", i);
+        return -1;
+      }
+    } else if (op < 8) {
+      if (sizes[k] == 0)
+        continue;
+      if (unqlite_kv_delete(db, key, -1) != UNQLITE_OK) {
+        fprintf(stderr, "slave defragment: delete %u failed\n", i);
+        return -1;
+      }
+      sizes[k] = 0;
+    } else if (op < 9) {
+      unqlite_commit(db);
+    } else if (checkModel(db, k, version[k], sizes[k]) != 0) {
+      return -1;
+    }
+  }
+  for (unsigned k = 0; k < MODEL_KEYS; k++) {
+    if (checkModel(db, k, version[k], sizes[k]) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+// lhAllocateSpace started its walk for a free block at the page header when
+// no free block was linked but the discarded leftovers of earlier
+// allocations added up to the request, and placed the new cell on top of
+// live ones. On a fresh database every record lands on the first bucket
+// page, so the page can be laid out exactly: fill it with no space left,
+// delete twelve cells and refill each hole with a cell three bytes smaller,
+// which leaves 3 bytes too small to link as a free block, then store a
+// cell of those 36 bytes.
+#define LEFTOVER_KEYS 64
+#define LEFTOVER_CELL(data) (26 + 5 + (data)) // cell header, key, data
+
+static int testLeftoverAllocate(unqlite *db) {
+  static const size_t page = 4096 - 12; // page size less the page header
+  size_t sizes[LEFTOVER_KEYS] = {0};
+  size_t full = page / LEFTOVER_CELL(64);
+  for (unsigned k = 0; k < full; k++)
+    sizes[k] = 64;
+  sizes[full] = page - full * LEFTOVER_CELL(64) - LEFTOVER_CELL(0);
+  int rc = UNQLITE_OK;
+  char key[8], buf[64];
+  for (unsigned k = 0; k <= full; k++) {
+    snprintf(key, sizeof(key), "c%04u", k);
+    fillPattern(buf, sizes[k], k);
+    rc |= unqlite_kv_store(db, key, 5, buf, sizes[k]);
+  }
+  for (unsigned k = 0; k < 12; k++) {
+    snprintf(key, sizeof(key), "c%04u", k);
+    rc |= unqlite_kv_delete(db, key, 5);
+    sizes[k] = 0;
+  }
+  for (unsigned k = full + 1; k <= full + 13; k++) {
+    sizes[k] = k <= full + 12 ? 61 : 5;
+    snprintf(key, sizeof(key), "c%04u", k);
+    fillPattern(buf, sizes[k], k);
+    rc |= unqlite_kv_store(db, key, 5, buf, sizes[k]);
+  }
+  if (rc != UNQLITE_OK) {
+    fprintf(stderr, "leftover allocate: store or delete failed\n");
+    return -1;
+  }
+
+  for (unsigned k = 0; k < LEFTOVER_KEYS; k++) {
+    if (sizes[k] == 0)
+      continue;
+    snprintf(key, sizeof(key), "c%04u", k);
+    fillPattern(buf, sizes[k], k);
+    if (checkRecord(db, key, buf, sizes[k], "leftover allocate") != 0)
+      return -1;
+  }
+  return 0;
+}
+
+// lhRecordAppend failed with UNQLITE_CORRUPT when the record's data ended
+// exactly at the end of an overflow page, instead of chaining a new page for
+// the appended bytes. Append to records of every size across the ends of
+// the first two overflow pages.
+static int testAppendPageEnd(unqlite *db) {
+  static char buf[16 << 10];
+  fillPattern(buf, sizeof(buf), 0);
+  for (size_t size = 4000; size <= 8200; size++) {
+    char key[16];
+    snprintf(key, sizeof(key), "a%zu", size);
+    if (unqlite_kv_store(db, key, -1, buf, size) != UNQLITE_OK) {
+      fprintf(stderr, "append at page end: store of %zu bytes failed\n", size);
+      return -1;
+    }
+    int rc = unqlite_kv_append(db, key, -1, buf + size, 100);
+    if (rc != UNQLITE_OK) {
+      fprintf(stderr, "append at page end: append to %zu bytes: rc %d\n",
+              size, rc);
+      return -1;
+    }
+    if (checkRecord(db, key, buf, size + 100, "append at page end") != 0)
+      return -1;
+  }
+  return 0;
+}
+
+static const struct {
+  const char *name;
+  int (*run)(unqlite *db);
+} tests[] = {
+    {"hot pages", testHotPages},
+    {"slave defragment", testSlaveDefragment},
+    {"leftover allocate", testLeftoverAllocate},
+    {"append at page end", testAppendPageEnd},
+};
+
+int main(void) {
+  char dir[] = "/tmp/unqlite-test.XXXXXX";
+  if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+    perror("unqlite_test");
+    return 1;
+  }
+
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+    unqlite *db;
+    unlink(TEST_DATABASE);
+    if (unqlite_open(&db, TEST_DATABASE, UNQLITE_OPEN_CREATE) != UNQLITE_OK) {
+      fprintf(stderr, "unqlite_test: cannot open %s\n", TEST_DATABASE);
+      return 1;
+    }
+    int rc = tests[i].run(db);
+    unqlite_close(db);
+    printf("%-24s %s\n", tests[i].name, rc == 0 ? "ok" : "FAILED");
+    if (rc != 0)
+      failed++;
+  }
+
+  unlink(TEST_DATABASE);
+  if (chdir("/") == 0)
+    rmdir(dir);
+  return failed != 0;
+}